@@ -1,10 +1,11 @@
 #include "PBKDF2.h"
-#include "util.h"
+#include "buffer.h"
+#include "stats.h"
 #include <chrono>
 
-std::string PBKDF2::PBKDF2(Hash& hash, const std::string& password, 
+SecureString PBKDF2::PBKDF2(Hash& hash, const SecureString& password,
     const std::string& salt, std::size_t iterations, std::size_t length) {
-  std::string res;
+  SecureString res;
 
   for (std::size_t i = 1; res.size() < length; i++)
     res += F(hash, password, salt, iterations, i);
@@ -12,17 +13,30 @@ std::string PBKDF2::PBKDF2(Hash& hash, const std::string& password,
   return res.substr(0, length);
 }
 
-std::string PBKDF2::F(Hash& hash, const std::string& password,
+// INT(i) as RFC 2898 has it would be big-endian, but volumes have always been
+// formatted with it little-endian
+static void block_index(char (&out)[4], std::uint32_t i) {
+  BufferWriter(out, sizeof(out)).le(i);
+}
+
+// Every intermediate value lives in the two buffers allocated up front
+SecureString PBKDF2::F(Hash& hash, const SecureString& password,
     const std::string& salt, std::size_t iterations, std::size_t i) {
+  stats::Timer timer("pbkdf2");
+  char index[4];
+  block_index(index, i);
   hash.reset();
-  hash.update(password+salt+htobe32_str(i));
-  std::string res, U = hash.digest();
+  hash.update(password);
+  hash.update(salt);
+  hash.update(index, sizeof(index));
+  SecureString res(hash.size(), '\x00'), U(hash.size(), '\x00');
+  hash.digest(&U[0]);
   res = U;
-  hash.reset();
   for (std::size_t i = 2; i < iterations; i++) {
-    hash.update(password + U);
-    U = hash.digest();
     hash.reset();
+    hash.update(password);
+    hash.update(U);
+    hash.digest(&U[0]);
     for (std::size_t j = 0; j < U.size(); j++)
       res[j] ^= U[j];
   }
@@ -35,15 +49,20 @@ std::size_t PBKDF2::benchmark(Hash& hash, std::size_t time) {
   int i = 1;
   auto stop = std::chrono::milliseconds(time);
   auto start = std::chrono::steady_clock::now();
+  char index[4];
+  block_index(index, 1);
   hash.reset();
-  hash.update(PASSWORD + SALT + htobe32_str(1));
-  std::string res, U = hash.digest();
+  hash.update(PASSWORD);
+  hash.update(SALT);
+  hash.update(index, sizeof(index));
+  std::string res(hash.size(), '\x00'), U(hash.size(), '\x00');
+  hash.digest(&U[0]);
   res = U;
-  hash.reset();
   while (true) {
-    hash.update(PASSWORD + U);
-    U = hash.digest();
     hash.reset();
+    hash.update(PASSWORD);
+    hash.update(U);
+    hash.digest(&U[0]);
     for (std::size_t j = 0; j < U.size(); j++)
       res[j] ^= U[j];
     i++;
@@ -7,9 +7,9 @@
 
 namespace PBKDF2 {
   std::size_t benchmark(Hash& hash, std::size_t time);
-  std::string F(Hash& hash, const std::string& password, 
+  SecureString F(Hash& hash, const SecureString& password,
       const std::string& salt, std::size_t iterations, std::size_t i);
-  std::string PBKDF2(Hash& hash, const std::string& password, 
+  SecureString PBKDF2(Hash& hash, const SecureString& password,
       const std::string& salt, std::size_t iterations, std::size_t length);
 }
 
@@ -0,0 +1,274 @@
+#include "allocator.h"
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+#include <unordered_map>
+
+static const std::size_t RANK_WORDS = 8;
+
+Bitmap::Bitmap(std::uint64_t size)
+    : _words((size+63)/64), _size(size), _count(0) {
+}
+
+std::uint64_t Bitmap::size() const {
+  return _size;
+}
+
+std::uint64_t Bitmap::count() const {
+  return _count;
+}
+
+bool Bitmap::test(std::uint64_t i) const {
+  if (i >= _size)
+    throw std::out_of_range("block out of range");
+  return _words[i/64] >> i%64 & 1;
+}
+
+void Bitmap::set(std::uint64_t i) {
+  if (test(i))
+    return;
+  _words[i/64] |= std::uint64_t(1) << i%64;
+  _count++;
+  _rank.clear();
+}
+
+void Bitmap::reset(std::uint64_t i) {
+  if (!test(i))
+    return;
+  _words[i/64] &= ~(std::uint64_t(1) << i%64);
+  _count--;
+  _rank.clear();
+}
+
+void Bitmap::recount() {
+  std::uint64_t count = 0;
+  for (std::size_t i = 0; i < _words.size(); i++)
+    count += __builtin_popcountll(_words[i]);
+  _count = count;
+  _rank.clear();
+}
+
+Bitmap& Bitmap::operator|=(const Bitmap& other) {
+  if (other._size != _size)
+    throw std::invalid_argument("bitmap sizes differ");
+  std::uint64_t* words = _words.data();
+  const std::uint64_t* others = other._words.data();
+  for (std::size_t i = 0; i < _words.size(); i++)
+    words[i] |= others[i];
+  recount();
+  return *this;
+}
+
+Bitmap& Bitmap::operator&=(const Bitmap& other) {
+  if (other._size != _size)
+    throw std::invalid_argument("bitmap sizes differ");
+  std::uint64_t* words = _words.data();
+  const std::uint64_t* others = other._words.data();
+  for (std::size_t i = 0; i < _words.size(); i++)
+    words[i] &= others[i];
+  recount();
+  return *this;
+}
+
+std::uint64_t Bitmap::count_common(const Bitmap& other) const {
+  if (other._size != _size)
+    throw std::invalid_argument("bitmap sizes differ");
+  std::uint64_t count = 0;
+  for (std::size_t i = 0; i < _words.size(); i++)
+    count += __builtin_popcountll(_words[i] & other._words[i]);
+  return count;
+}
+
+std::uint64_t Bitmap::next_clear(std::uint64_t i) const {
+  if (i >= _size)
+    return _size;
+  std::size_t word = i/64;
+  std::uint64_t clear = ~_words[word] & (~std::uint64_t(0) << i%64);
+  while (clear == 0) {
+    if (++word == _words.size())
+      return _size;
+    clear = ~_words[word];
+  }
+  return std::min<std::uint64_t>(word*64+__builtin_ctzll(clear), _size);
+}
+
+std::uint64_t Bitmap::select_clear(std::uint64_t k) const {
+  if (k >= _size-_count)
+    throw std::out_of_range("not enough clear bits");
+  if (_rank.empty()) {
+    _rank.reserve(_words.size()/RANK_WORDS+1);
+    std::uint64_t clear = 0;
+    for (std::size_t i = 0; i < _words.size(); i++) {
+      if (i%RANK_WORDS == 0)
+        _rank.push_back(clear);
+      clear += 64-__builtin_popcountll(_words[i]);
+    }
+  }
+
+  std::size_t word = (std::upper_bound(_rank.begin(), _rank.end(), k) -
+      _rank.begin() - 1)*RANK_WORDS;
+  k -= _rank[word/RANK_WORDS];
+  for (;; word++) {
+    std::uint64_t clear = ~_words[word];
+    std::uint64_t n = __builtin_popcountll(clear);
+    if (k < n) {
+      for (; k > 0; k--)
+        clear &= clear-1;
+      return word*64+__builtin_ctzll(clear);
+    }
+    k -= n;
+  }
+}
+
+Allocator::Allocator(std::uint64_t blocks)
+    : _allocated(blocks) {
+}
+
+std::uint64_t Allocator::blocks() const {
+  return _allocated.size();
+}
+
+std::uint64_t Allocator::free() const {
+  return _allocated.size()-_allocated.count();
+}
+
+bool Allocator::allocated(std::uint64_t block) const {
+  return _allocated.test(block);
+}
+
+void Allocator::mark(std::uint64_t block) {
+  _allocated.set(block);
+}
+
+void Allocator::release(std::uint64_t block) {
+  _allocated.reset(block);
+}
+
+// Positions of n clear bits chosen uniformly at random, in random order
+static std::vector<std::uint64_t> sample(const Bitmap& bitmap,
+    std::uint64_t n, RandomStream& random) {
+  std::uint64_t clear = bitmap.size()-bitmap.count();
+  if (n > clear)
+    throw std::out_of_range("not enough free space");
+  std::vector<std::uint64_t> ret;
+  ret.reserve(n);
+
+  if (n < clear/8) {
+    // Partial Fisher-Yates shuffle of the ranks of the clear bits, storing
+    // only the positions that were swapped.
+    std::unordered_map<std::uint64_t, std::uint64_t> swapped;
+    swapped.reserve(n);
+    auto at = [&](std::uint64_t i) {
+      auto it = swapped.find(i);
+      return it == swapped.end() ? i : it->second;
+    };
+    for (std::uint64_t i = 0; i < n; i++) {
+      std::uint64_t j = i+random.uniform(clear-i);
+      std::uint64_t rank = at(j);
+      swapped[j] = at(i);
+      ret.push_back(bitmap.select_clear(rank));
+    }
+  } else {
+    // Selection sampling in one pass over the clear bits, then a shuffle
+    std::uint64_t left = clear;
+    for (std::uint64_t i = bitmap.next_clear(0); ret.size() < n;
+        i = bitmap.next_clear(i+1), left--)
+      if (random.uniform(left) < n-ret.size())
+        ret.push_back(i);
+    for (std::uint64_t i = n; i > 1; i--)
+      std::swap(ret[i-1], ret[random.uniform(i)]);
+  }
+  return ret;
+}
+
+std::vector<std::uint64_t> Allocator::allocate(std::uint64_t n) {
+  auto ret = sample(_allocated, n, _random);
+  for (auto block : ret)
+    _allocated.set(block);
+  return ret;
+}
+
+std::vector<std::uint64_t> Allocator::allocate(std::uint64_t n,
+    std::uint64_t run) {
+  if (run <= 1)
+    return allocate(n);
+  if (n > free())
+    throw std::out_of_range("not enough free space");
+
+  // Runs are aligned to their length, and free if all of their blocks are.
+  Bitmap runs(blocks()/run);
+  for (std::uint64_t i = 0; i < runs.size(); i++)
+    for (std::uint64_t block = i*run; block < (i+1)*run; block++)
+      if (_allocated.test(block)) {
+        runs.set(i);
+        break;
+      }
+
+  std::vector<std::uint64_t> ret;
+  ret.reserve(n);
+  std::uint64_t count = std::min((n+run-1)/run, runs.size()-runs.count());
+  for (auto i : sample(runs, count, _random))
+    for (std::uint64_t block = i*run; block < (i+1)*run && ret.size() < n;
+        block++) {
+      ret.push_back(block);
+      _allocated.set(block);
+    }
+  // Once free space is too fragmented for whole runs, the rest is placed
+  // block by block.
+  if (ret.size() < n) {
+    auto rest = allocate(n-ret.size());
+    ret.insert(ret.end(), rest.begin(), rest.end());
+  }
+  return ret;
+}
+
+std::vector<std::uint64_t> Allocator::allocate(std::uint64_t n,
+    std::uint64_t run, const std::vector<std::uint64_t>& bounds) {
+  if (bounds.size() < 2 || bounds.back() > blocks())
+    throw std::out_of_range("allocation bounds");
+  if (bounds.size() == 2 && bounds.front() == 0 && bounds.back() == blocks())
+    return allocate(n, run);
+  run = std::max<std::uint64_t>(run, 1);
+
+  // Each range gets an allocator of its own, with what is free in it
+  std::vector<Allocator> ranges;
+  std::vector<std::uint64_t> room;
+  for (std::size_t i = 0; i+1 < bounds.size(); i++) {
+    ranges.emplace_back(bounds[i+1]-bounds[i]);
+    for (std::uint64_t block = bounds[i]; block < bounds[i+1]; block++)
+      if (_allocated.test(block))
+        ranges.back().mark(block-bounds[i]);
+    room.push_back(ranges.back().free());
+  }
+
+  // Deal the runs out in turn, skipping ranges that are full
+  if (n > std::accumulate(room.begin(), room.end(), std::uint64_t(0)))
+    throw std::out_of_range("not enough free space");
+  std::vector<std::pair<std::size_t, std::uint64_t>> order;
+  std::vector<std::uint64_t> counts(ranges.size(), 0);
+  std::size_t next = 0;
+  for (std::uint64_t left = n; left > 0; next = (next+1)%ranges.size()) {
+    if (counts[next] == room[next])
+      continue;
+    std::uint64_t size = std::min({run, left, room[next]-counts[next]});
+    order.emplace_back(next, size);
+    counts[next] += size;
+    left -= size;
+  }
+
+  std::vector<std::vector<std::uint64_t>> taken;
+  for (std::size_t i = 0; i < ranges.size(); i++)
+    taken.push_back(ranges[i].allocate(counts[i], run));
+  std::vector<std::uint64_t> ret;
+  ret.reserve(n);
+  std::vector<std::uint64_t> used(ranges.size(), 0);
+  for (const auto& piece : order) {
+    std::size_t i = piece.first;
+    for (std::uint64_t j = used[i]; j < used[i]+piece.second; j++) {
+      ret.push_back(bounds[i]+taken[i][j]);
+      _allocated.set(bounds[i]+taken[i][j]);
+    }
+    used[i] += piece.second;
+  }
+  return ret;
+}
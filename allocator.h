@@ -0,0 +1,69 @@
+#ifndef ALLOCATOR_H_
+#define ALLOCATOR_H_
+
+#include "crypto.h"
+#include <cstdint>
+#include <vector>
+
+class Bitmap {
+ public:
+  explicit Bitmap(std::uint64_t size = 0);
+
+  std::uint64_t size() const;
+  // Number of set bits
+  std::uint64_t count() const;
+
+  bool test(std::uint64_t i) const;
+  void set(std::uint64_t i);
+  void reset(std::uint64_t i);
+
+  // Whole-bitmap operations on bitmaps of the same size, a word at a time in
+  // loops simple enough for the compiler to vectorize
+  Bitmap& operator|=(const Bitmap&);
+  Bitmap& operator&=(const Bitmap&);
+  // Number of bits set in both
+  std::uint64_t count_common(const Bitmap&) const;
+
+  // First clear bit at or after i, or size() if there is none
+  std::uint64_t next_clear(std::uint64_t i) const;
+  // Position of the k-th clear bit, counting from zero
+  std::uint64_t select_clear(std::uint64_t k) const;
+
+ private:
+  std::vector<std::uint64_t> _words;
+  std::uint64_t _size, _count;
+
+  void recount();
+  // Clear bits before every RANK_WORDS words, rebuilt when needed
+  mutable std::vector<std::uint64_t> _rank;
+};
+
+// Tracks which blocks of a volume are allocated and hands out free blocks in
+// random order.
+class Allocator {
+ public:
+  explicit Allocator(std::uint64_t blocks);
+
+  std::uint64_t blocks() const;
+  std::uint64_t free() const;
+
+  bool allocated(std::uint64_t block) const;
+  void mark(std::uint64_t block);
+  void release(std::uint64_t block);
+
+  // Allocates n free blocks chosen uniformly at random
+  std::vector<std::uint64_t> allocate(std::uint64_t n);
+  // Allocates n free blocks as randomly placed runs of run contiguous blocks
+  std::vector<std::uint64_t> allocate(std::uint64_t n, std::uint64_t run);
+  // Same, but only between the first and last of bounds, with consecutive
+  // runs taken in turn from between each pair of adjacent bounds that still
+  // has room, such as the devices of a volume
+  std::vector<std::uint64_t> allocate(std::uint64_t n, std::uint64_t run,
+      const std::vector<std::uint64_t>& bounds);
+
+ private:
+  Bitmap _allocated;
+  RandomStream _random;
+};
+
+#endif  // ALLOCATOR_H_
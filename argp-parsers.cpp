@@ -1,14 +1,19 @@
 #include "argp-parsers.h"
 #include "blockdevice.h"
 #include "header.h"
+#include "stats.h"
 #include "util.h"
 
 argp_option params_options[] = {
   {"block-size", 'b', "BYTES", 0, "Block size in bytes", 0},
+  {"chunk-size", 'k', "BYTES", 0, "Size of partition header chunks in bytes",
+    0},
   {"disk-cipher", 'c', "CIPHER", 0,
     "Cipher to use to encrypt the DEVICE (see /proc/crypto)", 0},
   {"header-cipher", 'C', "CIPHER", 0,
     "Cipher to use to encrypt partition headers", 0},
+  {"header-mode", 'm', "MODE", 0,
+    "Cipher mode to use to encrypt partition headers", 0},
   {"hash", 'H', "HASH", 0,
     "Hash algorithm to use to generate partition keys from passphrases", 0},
   {"iter-time", 'i', "MS", 0, "PBKDF2 iteration time in milliseconds", 0},
@@ -16,14 +21,15 @@ argp_option params_options[] = {
   {nullptr, 0, nullptr, 0, nullptr, 0}
 };
 
-error_t parse_device(int key, char *arg, struct argp_state *state) {
+static error_t parse_device(int key, char *arg, struct argp_state *state,
+    bool read_only) {
   BlockDevice& device = *reinterpret_cast<BlockDevice*>(state->input);
   switch (key) {
     case ARGP_KEY_ARG:
       if (device.open())
         argp_failure(state, 1, 0, "Too many arguments");
       try {
-        device = BlockDevice(arg);
+        device = BlockDevice(arg, read_only);
       } catch(const std::exception& e) {
         argp_failure(state, 1, 0, e.what());
       }
@@ -38,6 +44,49 @@ error_t parse_device(int key, char *arg, struct argp_state *state) {
   return 0;
 }
 
+error_t parse_device(int key, char *arg, struct argp_state *state) {
+  return parse_device(key, arg, state, false);
+}
+
+error_t parse_readonly_device(int key, char *arg, struct argp_state *state) {
+  return parse_device(key, arg, state, true);
+}
+
+// Every device of a volume that spans several
+error_t parse_devices(int key, char *arg, struct argp_state *state) {
+  auto& devices = *reinterpret_cast<std::vector<BlockDevice>*>(state->input);
+  switch (key) {
+    case ARGP_KEY_ARG:
+      try {
+        devices.emplace_back(arg);
+      } catch(const std::exception& e) {
+        argp_failure(state, 1, 0, e.what());
+      }
+      break;
+    case ARGP_KEY_END:
+      if (devices.empty())
+        argp_failure(state, 1, 0, "Too few arguments");
+      break;
+    default:
+      return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
+
+argp_option stats_options[] = {
+  {"stats", 0x100, "FILE", 0, "Append timings and I/O counts of this run to "
+    "FILE as JSON, or write them to standard error if FILE is -. The "
+    "DDE_STATS environment variable does the same.", 0},
+  {nullptr, 0, nullptr, 0, nullptr, 0}
+};
+
+error_t parse_stats(int key, char *arg, struct argp_state *) {
+  if (key != 0x100)
+    return ARGP_ERR_UNKNOWN;
+  stats::enable(arg);
+  return 0;
+}
+
 error_t parse_params(int key, char *arg, struct argp_state *state) {
   Params& params = *reinterpret_cast<Params*>(state->input);
   switch(key) {
@@ -48,12 +97,27 @@ error_t parse_params(int key, char *arg, struct argp_state *state) {
       if (params.block_size % 512)
         argp_failure(state, 1, 0, "Block size must be a multiple of 512 bytes");
       break;
+    case 'k':
+      params.chunk_size = std::max(from_string<int>(arg), 0);
+      if (params.chunk_size == 0)
+        argp_failure(state, 1, 0, "Chunk size must be a positive integer");
+      if (params.chunk_size % 512)
+        argp_failure(state, 1, 0, "Chunk size must be a multiple of 512 bytes");
+      break;
     case 'c':
       params.device_cipher = arg;
       break;
     case 'C':
       params.superblock_cipher = arg;
       break;
+    case 'm':
+      params.superblock_mode = arg;
+      try {
+        cipher_mode(params.superblock_mode);
+      } catch(const std::exception& e) {
+        argp_failure(state, 1, 0, e.what());
+      }
+      break;
     case 'H':
       params.hash = arg;
       break;
@@ -75,7 +139,11 @@ error_t parse_params(int key, char *arg, struct argp_state *state) {
 
 argp parsers[] = {
   {nullptr, parse_device, "DEVICE", nullptr, nullptr, nullptr, nullptr},
-  {params_options, parse_params, nullptr, nullptr, nullptr, nullptr, nullptr}
+  {params_options, parse_params, nullptr, nullptr, nullptr, nullptr, nullptr},
+  {nullptr, parse_readonly_device, "DEVICE", nullptr, nullptr, nullptr,
+    nullptr},
+  {stats_options, parse_stats, nullptr, nullptr, nullptr, nullptr, nullptr},
+  {nullptr, parse_devices, "DEVICE...", nullptr, nullptr, nullptr, nullptr}
 };
 
 std::unique_ptr<argp_child[]> new_subparser(const std::vector<std::string>& p) {
@@ -92,6 +160,21 @@ std::unique_ptr<argp_child[]> new_subparser(const std::vector<std::string>& p) {
       next_child->flags = 0;
       next_child->header = nullptr;
       next_child->group = 0;
+    } else if (parser == "readonly-device") {
+      next_child->argp = parsers+2;
+      next_child->flags = 0;
+      next_child->header = nullptr;
+      next_child->group = 0;
+    } else if (parser == "stats") {
+      next_child->argp = parsers+3;
+      next_child->flags = 0;
+      next_child->header = nullptr;
+      next_child->group = 0;
+    } else if (parser == "devices") {
+      next_child->argp = parsers+4;
+      next_child->flags = 0;
+      next_child->header = nullptr;
+      next_child->group = 0;
     } else {
       throw std::invalid_argument(parser);
     }
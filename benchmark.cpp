@@ -0,0 +1,197 @@
+#include "allocator.h"
+#include "blockdevice.h"
+#include "crypto.h"
+#include "diskcipher.h"
+#include "header.h"
+#include "PBKDF2.h"
+#include <argp.h>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <sstream>
+
+const char* doc = "Measure the speed of hot paths\vEvery result is printed "
+  "as one line of JSON, with the name of the benchmark, its parameters, and "
+  "operations and bytes per second.";
+
+argp_option options[] = {
+  {"time", 't', "MS", 0, "Run every benchmark for at least MS milliseconds",
+    0},
+  {"filter", 'f', "NAME", 0, "Only run benchmarks whose name starts with "
+    "NAME", 0},
+  {nullptr, 0, nullptr, 0, nullptr, 0}
+};
+
+struct State {
+  std::chrono::milliseconds time{500};
+  std::string filter;
+};
+
+error_t parse(int key, char* arg, argp_state* state) {
+  State& args = *reinterpret_cast<State*>(state->input);
+  switch (key) {
+    case 't':
+      args.time = std::chrono::milliseconds(std::max<std::int64_t>(
+            from_string<std::int64_t>(arg), 1));
+      break;
+    case 'f':
+      args.filter = arg;
+      break;
+    default:
+      return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
+
+State state;
+
+// Runs op until the time is up, and prints its rate. Every call of op is
+// one operation on bytes bytes.
+void run(const std::string& name, const std::string& params,
+    std::uint64_t bytes, const std::function<void()>& op) {
+  if (name.compare(0, state.filter.size(), state.filter) != 0)
+    return;
+  op();
+  std::uint64_t ops = 0;
+  auto start = std::chrono::steady_clock::now();
+  std::chrono::duration<double> elapsed;
+  do {
+    op();
+    ops++;
+    elapsed = std::chrono::steady_clock::now()-start;
+  } while (elapsed < state.time);
+  double rate = ops/elapsed.count();
+  std::cout << "{\"name\":\"" << name << "\",\"params\":{" << params
+    << "},\"ops_per_sec\":" << rate << ",\"bytes_per_sec\":" << rate*bytes
+    << "}" << std::endl;
+}
+
+std::string param(const std::string& key, const std::string& value) {
+  return "\"" + key + "\":\"" + value + "\"";
+}
+
+std::string param(const std::string& key, std::uint64_t value) {
+  return "\"" + key + "\":" + std::to_string(value);
+}
+
+void crypto() {
+  std::string data(64 << 10, 'x');
+  for (auto algo : {"SHA256", "SHA512"}) {
+    Hash hash(algo);
+    run("hash", param("algo", algo) + "," + param("size", data.size()),
+        data.size(), [&]() {
+          hash.reset();
+          hash.update(data);
+          hash.digest();
+        });
+  }
+
+  for (auto mode : {"CBC", "GCM", "OCB"}) {
+    Symmetric cipher("AES256", cipher_mode(mode));
+    cipher.set_key(std::string(cipher.key_size(), 'k'));
+    run("symmetric", param("algo", "AES256") + "," + param("mode", mode) +
+        "," + param("size", data.size()), data.size(), [&]() {
+          cipher.reset(std::string(cipher.aead() ? 12 : 16, 'i'));
+          cipher.encrypt(&data[0], data.size());
+        });
+  }
+
+  for (auto spec : {"aes-cbc-essiv:sha256", "aes-xts-plain64"}) {
+    DiskCipher cipher(spec, SecureString(spec[4] == 'x' ? 64 : 32, 'k'));
+    run("disk_cipher", param("cipher", spec) + "," +
+        param("size", data.size()), data.size(), [&]() {
+          cipher.encrypt(&data[0], data.size(), 0);
+        });
+  }
+
+  // Rate of single PBKDF2 iterations
+  const std::size_t ITERATIONS = 10000;
+  Hash hash("SHA256");
+  run("pbkdf2", param("hash", "SHA256") + "," +
+      param("iterations", ITERATIONS), 0, [&]() {
+        PBKDF2::F(hash, "passphrase", "salt", ITERATIONS, 1);
+      });
+}
+
+Params params(std::size_t block_size) {
+  Params params;
+  params.block_size = block_size;
+  params.chunk_size = std::min<std::size_t>(64 << 10, block_size);
+  params.iters = 1;
+  params.key_size = 32;
+  params.hash = "SHA256";
+  params.device_cipher = "aes-xts-plain64";
+  params.superblock_cipher = "AES256";
+  params.superblock_mode = "GCM";
+  params.salt = nonce(16);
+  return params;
+}
+
+void header() {
+  {
+    Params p = params(4 << 20);
+    BlockDevice device = BlockDevice::memory(p.block_size);
+    run("params_store", "", 0, [&]() { p.store(device); });
+    run("params_load", "", 0, [&]() { p.load(device); });
+  }
+
+  for (std::size_t block_size : {64 << 10, 1 << 20, 4 << 20}) {
+    for (std::uint64_t entries : {1000, 100000, 1000000}) {
+      Params p = params(block_size);
+      std::uint64_t offset = Superblock::size_in_blocks(p, entries);
+      std::uint64_t blocks = 2*(entries+offset)+1;
+      Superblock superblock(p, "passphrase", blocks);
+      // Sparse, so only what is written takes memory
+      BlockDevice device = BlockDevice::memory(blocks*block_size);
+      Allocator allocator(blocks);
+      allocator.mark(0);
+      allocator.mark(superblock.blocks.front());
+      for (auto block : allocator.allocate(entries+offset-1))
+        superblock.blocks.push_back(block);
+      superblock.offset = offset;
+      superblock.logical_iv = true;
+      superblock.store(device);
+
+      std::string params = param("block_size", block_size) + "," +
+        param("entries", entries);
+      run("superblock_store", params, 0, [&]() {
+            // Moving the root in place forces a full store
+            superblock.set(0, superblock.blocks[0]);
+            superblock.store(device);
+          });
+      run("superblock_store_one", params, 0, [&]() {
+            superblock.set(offset, superblock.blocks[offset]);
+            superblock.store(device);
+          });
+      run("superblock_load", params, 0, [&]() { superblock.load(device); });
+    }
+  }
+}
+
+void allocation() {
+  const std::uint64_t BLOCKS = 10000000;
+  for (std::uint64_t n : {std::uint64_t(1000), std::uint64_t(100000),
+      BLOCKS/2}) {
+    for (std::uint64_t run_length : {1, 16}) {
+      run("allocate", param("blocks", BLOCKS) + "," + param("n", n) + "," +
+          param("run_length", run_length), 0, [&]() {
+            Allocator allocator(BLOCKS);
+            allocator.allocate(n, run_length);
+          });
+    }
+  }
+}
+
+int main(int argc, char *argv[])
+  try {
+    argp argp = {options, parse, nullptr, doc, nullptr, nullptr, nullptr};
+    argp_parse(&argp, argc, argv, 0, nullptr, &state);
+
+    crypto();
+    header();
+    allocation();
+    return 0;
+  } catch(const std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
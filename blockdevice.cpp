@@ -1,4 +1,5 @@
 #include "blockdevice.h"
+#include "stats.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -6,20 +7,35 @@
 #include <cerrno>
 #include <system_error>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <linux/fs.h>
 
 BlockDevice::BlockDevice()
   : _fd(-1) {
 }
 
-BlockDevice::BlockDevice(const std::string& name)
-  : _fd(::open(name.c_str(), O_RDWR)) {
+BlockDevice::BlockDevice(const std::string& name, bool read_only)
+  : _fd(::open(name.c_str(), read_only ? O_RDONLY : O_RDWR)) {
   if (_fd == -1)
     throw std::system_error(errno, std::system_category());
 }
 
+BlockDevice::BlockDevice(int fd)
+  : _fd(fd) {
+  if (_fd == -1)
+    throw std::system_error(errno, std::system_category());
+}
+
+BlockDevice BlockDevice::memory(std::uint64_t size) {
+  BlockDevice ret(memfd_create("blockdevice", 0));
+  if (ftruncate(ret._fd, size) == -1)
+    throw std::system_error(errno, std::system_category());
+  return ret;
+}
+
 BlockDevice::BlockDevice(BlockDevice&& dev)
   : _fd(dev._fd) {
+  dev._fd = -1;
 }
 
 BlockDevice::~BlockDevice() {
@@ -55,6 +71,7 @@ std::string BlockDevice::read(std::size_t n) {
   std::size_t total = 0;
   ssize_t current;
   while (total < n) {
+    stats::count("read_calls");
     if ((current = ::read(_fd, buf+total, n-total)) == -1) {
       delete[] buf;
       throw std::system_error(errno, std::system_category());
@@ -63,6 +80,7 @@ std::string BlockDevice::read(std::size_t n) {
     }
     total += current;
   }
+  stats::count("read_bytes", n);
   std::string ret(buf, n);
   delete[] buf;
   return ret;
@@ -72,13 +90,21 @@ void BlockDevice::write(const std::string& data) {
   std::size_t total = 0;
   ssize_t current;
   while (total < data.size()) {
+    stats::count("write_calls");
     if ((current = ::write(_fd, data.data()+total, data.size()-total)) == -1)
       throw std::system_error(errno, std::system_category());
     total += current;
   }
+  stats::count("write_bytes", total);
 }
 
 std::uint64_t BlockDevice::size() const {
+  // Images of volumes can be used as well
+  struct stat info;
+  if (fstat(_fd, &info) == -1)
+    throw std::system_error(errno, std::system_category());
+  if (S_ISREG(info.st_mode))
+    return info.st_size;
   std::uint64_t res;
   if (ioctl(_fd, BLKGETSIZE64, &res) == -1)
     throw std::system_error(errno, std::system_category());
@@ -91,3 +117,51 @@ off_t BlockDevice::seek(off_t offset, int whence) {
     throw std::system_error(errno, std::system_category());
   return ret;
 }
+
+void BlockDevice::direct(bool enable) {
+  int flags = fcntl(_fd, F_GETFL);
+  if (flags == -1)
+    throw std::system_error(errno, std::system_category());
+  flags = enable ? flags | O_DIRECT : flags & ~O_DIRECT;
+  if (fcntl(_fd, F_SETFL, flags) == -1)
+    throw std::system_error(errno, std::system_category());
+}
+
+void BlockDevice::sync() {
+  stats::Timer timer("sync");
+  if (fdatasync(_fd) == -1)
+    throw std::system_error(errno, std::system_category());
+}
+
+void BlockDevice::pread(void* buf, std::size_t n, off_t offset) const {
+  std::size_t total = 0;
+  ssize_t current;
+  while (total < n) {
+    stats::count("read_calls");
+    if ((current = ::pread(_fd, static_cast<char*>(buf)+total, n-total,
+            offset+total)) == -1)
+      throw std::system_error(errno, std::system_category());
+    else if (current == 0)
+      throw std::out_of_range("EOF reached");
+    total += current;
+  }
+  stats::count("read_bytes", n);
+}
+
+void BlockDevice::prefetch(std::size_t n, off_t offset) const {
+  // Only a hint, so failures don't matter
+  posix_fadvise(_fd, offset, n, POSIX_FADV_WILLNEED);
+}
+
+void BlockDevice::pwrite(const void* buf, std::size_t n, off_t offset) {
+  std::size_t total = 0;
+  ssize_t current;
+  while (total < n) {
+    stats::count("write_calls");
+    if ((current = ::pwrite(_fd, static_cast<const char*>(buf)+total,
+            n-total, offset+total)) == -1)
+      throw std::system_error(errno, std::system_category());
+    total += current;
+  }
+  stats::count("write_bytes", n);
+}
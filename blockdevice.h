@@ -9,13 +9,16 @@
 class BlockDevice {
  public:
   BlockDevice();
-  explicit BlockDevice(const std::string&);
+  explicit BlockDevice(const std::string&, bool read_only = false);
   BlockDevice(const BlockDevice&) = delete;
   BlockDevice(BlockDevice&&);
   ~BlockDevice();
   BlockDevice& operator=(const BlockDevice&) = delete;
   BlockDevice& operator=(BlockDevice&&);
 
+  // A device of size bytes backed by anonymous memory, for benchmarks
+  static BlockDevice memory(std::uint64_t size);
+
   bool open() const;
   unsigned major() const;
   unsigned minor() const;
@@ -23,10 +26,22 @@ class BlockDevice {
   std::string read(std::size_t n);
   void write(const std::string&);
   off_t seek(off_t offset, int whence = SEEK_SET);
+  void sync();
+  // Bypass the page cache. Buffers, offsets and sizes must then be aligned
+  // to the logical block size of the device.
+  void direct(bool enable);
+  // Positioned I/O, safe to use from several threads at once
+  void pread(void* buf, std::size_t n, off_t offset) const;
+  void pwrite(const void* buf, std::size_t n, off_t offset);
+  // Starts reading into the page cache in the background, so that reads
+  // from several places are in flight at once
+  void prefetch(std::size_t n, off_t offset) const;
 
   std::uint64_t size() const;
 
  private:
+  explicit BlockDevice(int fd);
+
   int _fd;
 };
 
@@ -0,0 +1,196 @@
+#ifndef BUFFER_H_
+#define BUFFER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+// Fixed-width integers in a given byte order, converted at compile time when
+// the byte order matches the host's.
+namespace endian {
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+constexpr bool little = false;
+#else
+constexpr bool little = true;
+#endif
+
+template <class T> struct Swap;
+
+template <> struct Swap<std::uint8_t> {
+  static constexpr std::uint8_t swap(std::uint8_t i) { return i; }
+};
+
+template <> struct Swap<std::uint16_t> {
+  static constexpr std::uint16_t swap(std::uint16_t i) {
+    return __builtin_bswap16(i);
+  }
+};
+
+template <> struct Swap<std::uint32_t> {
+  static constexpr std::uint32_t swap(std::uint32_t i) {
+    return __builtin_bswap32(i);
+  }
+};
+
+template <> struct Swap<std::uint64_t> {
+  static constexpr std::uint64_t swap(std::uint64_t i) {
+    return __builtin_bswap64(i);
+  }
+};
+
+template <class T> constexpr T to_le(T i) {
+  return little ? i : Swap<T>::swap(i);
+}
+
+template <class T> constexpr T to_be(T i) {
+  return little ? Swap<T>::swap(i) : i;
+}
+
+// Both conversions are their own inverse
+template <class T> constexpr T from_le(T i) { return to_le(i); }
+template <class T> constexpr T from_be(T i) { return to_be(i); }
+
+}  // namespace endian
+
+// Writes into a caller-owned buffer, throwing std::out_of_range instead of
+// running past its end.
+class BufferWriter {
+ public:
+  BufferWriter(void* data, std::size_t size)
+    : _data(static_cast<char*>(data)), _size(size) {
+  }
+
+  std::size_t size() const { return _size; }
+  std::size_t pos() const { return _pos; }
+  std::size_t remaining() const { return _size-_pos; }
+
+  void seek(std::size_t pos) {
+    if (pos > _size)
+      throw std::out_of_range("buffer overflow");
+    _pos = pos;
+  }
+
+  template <class T> void le(T i) {
+    static_assert(std::is_unsigned<T>::value, "unsigned integers only");
+    i = endian::to_le(i);
+    bytes(&i, sizeof(i));
+  }
+
+  template <class T> void be(T i) {
+    static_assert(std::is_unsigned<T>::value, "unsigned integers only");
+    i = endian::to_be(i);
+    bytes(&i, sizeof(i));
+  }
+
+  // Seven bits at a time, least significant first
+  void varint(std::uint64_t i) {
+    while (i >= 0x80) {
+      byte((i & 0x7F) | 0x80);
+      i >>= 7;
+    }
+    byte(i);
+  }
+
+  void byte(unsigned char c) {
+    bytes(&c, 1);
+  }
+
+  void bytes(const void* data, std::size_t n) {
+    if (n > remaining())
+      throw std::out_of_range("buffer overflow");
+    std::memcpy(_data+_pos, data, n);
+    _pos += n;
+  }
+
+  void bytes(const std::string& data) {
+    bytes(data.data(), data.size());
+  }
+
+ private:
+  char* _data;
+  std::size_t _size, _pos = 0;
+};
+
+// Reads from a caller-owned buffer, throwing std::out_of_range instead of
+// running past its end.
+class BufferReader {
+ public:
+  BufferReader(const void* data, std::size_t size)
+    : _data(static_cast<const char*>(data)), _size(size) {
+  }
+  explicit BufferReader(const std::string& data)
+    : BufferReader(data.data(), data.size()) {
+  }
+
+  std::size_t size() const { return _size; }
+  std::size_t pos() const { return _pos; }
+  std::size_t remaining() const { return _size-_pos; }
+  const char* data() const { return _data+_pos; }
+
+  void seek(std::size_t pos) {
+    if (pos > _size)
+      throw std::out_of_range("truncated buffer");
+    _pos = pos;
+  }
+
+  void skip(std::size_t n) {
+    if (n > remaining())
+      throw std::out_of_range("truncated buffer");
+    _pos += n;
+  }
+
+  template <class T> T le() {
+    static_assert(std::is_unsigned<T>::value, "unsigned integers only");
+    T i;
+    bytes(&i, sizeof(i));
+    return endian::from_le(i);
+  }
+
+  template <class T> T be() {
+    static_assert(std::is_unsigned<T>::value, "unsigned integers only");
+    T i;
+    bytes(&i, sizeof(i));
+    return endian::from_be(i);
+  }
+
+  std::uint64_t varint() {
+    std::uint64_t ret = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+      unsigned char c = byte();
+      ret |= std::uint64_t(c & 0x7F) << shift;
+      if (!(c & 0x80))
+        return ret;
+    }
+    throw std::out_of_range("malformed varint");
+  }
+
+  unsigned char byte() {
+    unsigned char c;
+    bytes(&c, 1);
+    return c;
+  }
+
+  void bytes(void* data, std::size_t n) {
+    if (n > remaining())
+      throw std::out_of_range("truncated buffer");
+    std::memcpy(data, _data+_pos, n);
+    _pos += n;
+  }
+
+  std::string string(std::size_t n) {
+    if (n > remaining())
+      throw std::out_of_range("truncated buffer");
+    _pos += n;
+    return std::string(_data+_pos-n, n);
+  }
+
+ private:
+  const char* _data;
+  std::size_t _size, _pos = 0;
+};
+
+#endif  // BUFFER_H_
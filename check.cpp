@@ -0,0 +1,200 @@
+#include "allocator.h"
+#include "blockdevice.h"
+#include "header.h"
+#include "pinentry.h"
+#include "argp-parsers.h"
+#include <argp.h>
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <thread>
+
+const char* doc = "Check the partitions on DEVICE for consistency\vReports "
+  "partitions whose superblock can't be loaded, entries pointing past the "
+  "end of DEVICE, blocks used twice and blocks shared between partitions. "
+  "Exits with status 1 if any are found.";
+
+argp_option options[] = {
+  {"threads", 'j', "N", 0, "Number of superblocks to load at once", 0},
+  {nullptr, 0, nullptr, 0, nullptr, 0}
+};
+
+struct State {
+  BlockDevice device;
+  unsigned threads = std::max(std::thread::hardware_concurrency(), 1u);
+};
+
+error_t init_parsers(int key, char* arg, argp_state* state) {
+  State& args = *reinterpret_cast<State*>(state->input);
+  switch (key) {
+    case 'j':
+      args.threads = std::max<std::int64_t>(from_string<std::int64_t>(arg), 0);
+      if (args.threads == 0)
+        argp_failure(state, 1, 0, "Number of threads must be positive");
+      break;
+    case ARGP_KEY_INIT:
+      state->child_inputs[0] = &args.device;
+      break;
+    default:
+      return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
+
+struct Partition {
+  std::string error;
+  std::uint64_t mapped = 0, holes = 0, superblock_blocks = 0;
+  std::uint64_t out_of_range = 0, duplicates = 0;
+  Bitmap blocks;
+};
+
+void load(Partition& partition, const Params& params,
+    const SecureString& passphrase, BlockDevice& device,
+    std::uint64_t blocks) {
+  Superblock superblock(params, passphrase, blocks);
+  try {
+    superblock.load(device);
+  } catch(const std::exception& e) {
+    partition.error = e.what();
+    return;
+  }
+  partition.blocks = Bitmap(blocks);
+  for (std::size_t entry = 0; entry < superblock.blocks.size(); entry++) {
+    std::uint64_t block = superblock.blocks[entry];
+    if (block == 0) {
+      // Holes are only allowed among the data entries
+      if (entry < superblock.offset)
+        partition.out_of_range++;
+      else
+        partition.holes++;
+      continue;
+    }
+    (entry < superblock.offset ? partition.superblock_blocks :
+     partition.mapped)++;
+    if (block >= blocks)
+      partition.out_of_range++;
+    else if (partition.blocks.test(block))
+      partition.duplicates++;
+    else
+      partition.blocks.set(block);
+  }
+}
+
+int main(int argc, char *argv[])
+  try {
+    State state;
+    auto parsers = new_subparser({"readonly-device", "stats"});
+    argp argp = {options, init_parsers, nullptr, doc, parsers.get(), nullptr,
+      nullptr};
+    argp_parse(&argp, argc, argv, 0, nullptr, &state);
+
+    Params params;
+
+    try {
+      params.load(state.device);
+    } catch(const std::exception& e) {
+      std::cerr << "Error: Header corrupt." << std::endl;
+      return 1;
+    }
+    if (!params.devices.empty()) {
+      std::cerr << "Error: Volumes on several devices aren't supported by "
+        "this tool yet." << std::endl;
+      return 1;
+    }
+    std::uint64_t blocks = state.device.size()/params.block_size;
+
+    std::vector<SecureString> passphrases;
+    SecureString passphrase;
+    Pinentry pinentry;
+    pinentry.SETDESC("Enter passphrases for the partitions to check. Enter an "
+        "empty passphrase after last passphrase.");
+    pinentry.SETPROMPT("Passphrase:");
+    while ((passphrase = pinentry.GETPIN()) != "")
+      passphrases.push_back(passphrase);
+
+    // Loading is mostly key derivation, so superblocks are loaded in
+    // parallel.
+    std::vector<Partition> partitions(passphrases.size());
+    std::atomic<std::size_t> next(0);
+    auto worker = [&]() {
+      std::size_t i;
+      while ((i = next++) < partitions.size())
+        load(partitions[i], params, passphrases[i], state.device, blocks);
+    };
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < std::min<std::size_t>(state.threads,
+          partitions.size()); i++)
+      threads.emplace_back(worker);
+    worker();
+    for (auto& thread : threads)
+      thread.join();
+
+    std::uint64_t problems = 0;
+    // Blocks used by more than one partition, or by one and the header
+    Bitmap used(blocks), shared(blocks);
+    used.set(0);
+    for (std::size_t i = 0; i < partitions.size(); i++) {
+      const Partition& partition = partitions[i];
+      std::cout << "Partition " << i+1 << ": ";
+      if (!partition.error.empty()) {
+        std::cout << "Error: " << partition.error << std::endl;
+        problems++;
+        continue;
+      }
+      std::cout << partition.mapped << " blocks mapped, " << partition.holes
+        << " unmapped, superblock in " << partition.superblock_blocks
+        << " blocks." << std::endl;
+      if (partition.out_of_range) {
+        std::cout << "Partition " << i+1 << ": " << partition.out_of_range
+          << " entries out of range." << std::endl;
+        problems++;
+      }
+      if (partition.duplicates) {
+        std::cout << "Partition " << i+1 << ": " << partition.duplicates
+          << " blocks used twice." << std::endl;
+        problems++;
+      }
+      Bitmap overlap = used;
+      overlap &= partition.blocks;
+      shared |= overlap;
+      used |= partition.blocks;
+    }
+
+    // Only pairs that do overlap are worth the pairwise intersections
+    if (shared.count() > 0) {
+      for (std::size_t i = 0; i < partitions.size(); i++) {
+        if (!partitions[i].error.empty())
+          continue;
+        if (partitions[i].blocks.test(0)) {
+          std::cout << "Partition " << i+1 << " uses the volume header."
+            << std::endl;
+          problems++;
+        }
+        if (partitions[i].blocks.count_common(shared) == 0)
+          continue;
+        for (std::size_t j = i+1; j < partitions.size(); j++) {
+          if (!partitions[j].error.empty())
+            continue;
+          std::uint64_t common = partitions[i].blocks.count_common(
+              partitions[j].blocks);
+          if (common) {
+            std::cout << "Partitions " << i+1 << " and " << j+1 << " share "
+              << common << " blocks." << std::endl;
+            problems++;
+          }
+        }
+      }
+    }
+
+    std::cout << blocks-used.count() << " of " << blocks
+      << " blocks not used by these partitions." << std::endl;
+    if (problems) {
+      std::cout << problems << " problems found." << std::endl;
+      return 1;
+    }
+    std::cout << "No problems found." << std::endl;
+    return 0;
+  } catch(const std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
@@ -0,0 +1,82 @@
+#include "copy.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <exception>
+#include <memory>
+#include <thread>
+
+// Largest single read or write
+static const std::size_t PIECE_SIZE = 1 << 20;
+static const std::size_t ALIGNMENT = 4096;
+
+CopyEngine::CopyEngine(std::uint64_t block_size, unsigned queue_depth,
+    std::uint64_t bandwidth)
+  : _block_size(block_size),
+    _queue_depth(std::max(queue_depth, 1u)), _bandwidth(bandwidth),
+    _next(std::chrono::steady_clock::now()) {
+}
+
+// Every request reserves its share of the bandwidth and waits for its turn,
+// so the rate holds however many threads there are.
+void CopyEngine::throttle(std::size_t n) {
+  if (_bandwidth == 0)
+    return;
+  std::chrono::steady_clock::time_point start;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto now = std::chrono::steady_clock::now();
+    if (_next < now)
+      _next = now;
+    start = _next;
+    _next += std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(static_cast<double>(n)/_bandwidth));
+  }
+  std::this_thread::sleep_until(start);
+}
+
+void CopyEngine::copy(const BlockDevice& from, BlockDevice& to,
+    const std::vector<std::pair<std::uint64_t, std::uint64_t>>& moves) {
+  std::atomic<std::size_t> index(0);
+  std::atomic<bool> failed(false);
+  std::exception_ptr error;
+  std::mutex error_mutex;
+
+  auto worker = [&]() {
+    std::size_t piece = std::min<std::uint64_t>(_block_size, PIECE_SIZE);
+    try {
+      void* p;
+      if (posix_memalign(&p, ALIGNMENT, piece) != 0)
+        throw std::bad_alloc();
+      std::unique_ptr<char, void(*)(void*)> buf(static_cast<char*>(p),
+          std::free);
+      std::size_t i;
+      while (!failed && (i = index++) < moves.size()) {
+        off_t source = moves[i].first*_block_size;
+        off_t destination = moves[i].second*_block_size;
+        for (std::uint64_t done = 0; done < _block_size; done += piece) {
+          std::size_t n = std::min<std::uint64_t>(piece, _block_size-done);
+          throttle(n);
+          from.pread(buf.get(), n, source+done);
+          to.pwrite(buf.get(), n, destination+done);
+        }
+      }
+    } catch(...) {
+      std::lock_guard<std::mutex> lock(error_mutex);
+      if (!failed)
+        error = std::current_exception();
+      failed = true;
+    }
+  };
+
+  std::vector<std::thread> threads;
+  unsigned count = std::min<std::size_t>(_queue_depth, moves.size());
+  for (unsigned i = 1; i < count; i++)
+    threads.emplace_back(worker);
+  worker();
+  for (auto& thread : threads)
+    thread.join();
+  if (error)
+    std::rethrow_exception(error);
+  to.sync();
+}
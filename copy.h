@@ -0,0 +1,33 @@
+#ifndef COPY_H_
+#define COPY_H_
+
+#include "blockdevice.h"
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Copies blocks between devices, keeping several requests in flight and
+// optionally capping the bandwidth used. Buffers are aligned for direct I/O.
+class CopyEngine {
+ public:
+  // bandwidth is in bytes per second, 0 for unlimited
+  CopyEngine(std::uint64_t block_size, unsigned queue_depth = 4,
+      std::uint64_t bandwidth = 0);
+
+  // Copies every block first of from to block second of to, and syncs to
+  void copy(const BlockDevice& from, BlockDevice& to,
+      const std::vector<std::pair<std::uint64_t, std::uint64_t>>& moves);
+
+ private:
+  void throttle(std::size_t n);
+
+  std::uint64_t _block_size;
+  unsigned _queue_depth;
+  std::uint64_t _bandwidth;
+  std::mutex _mutex;
+  std::chrono::steady_clock::time_point _next;
+};
+
+#endif  // COPY_H_
@@ -1,14 +1,19 @@
+#include "allocator.h"
 #include "blockdevice.h"
 #include "header.h"
+#include "layout.h"
 #include "pinentry.h"
 #include "argp-parsers.h"
 #include <argp.h>
 #include <iostream>
 #include <cstdlib>
 #include <algorithm>
-#include <random>
+#include <fstream>
+#include <memory>
 
-const char* doc = "Create a new encrypted partition on DEVICE";
+const char* doc = "Create a new encrypted partition on DEVICE, or several at "
+  "once with --new\vA volume on several devices takes all of them, in any "
+  "order.";
 
 argp_option options[] = {
   {"blocks", 'b', "BLOCKS", 0, "Number of blocks to allocate for the "
@@ -16,13 +21,35 @@ argp_option options[] = {
   {"partition-size", 's', "BLOCKS", 0, "Size of the partition in blocks. "
     "This can be greater than the number of blocks allocated for the "
     "partition.", 0},
+  {"run-length", 'r', "BLOCKS", 0, "Place the partition in runs of BLOCKS "
+    "physically contiguous blocks. Longer runs make sequential access faster "
+    "on rotating disks, at the cost of a less random layout.", 0},
+  {"new", 'N', "BLOCKS[,SIZE[,FILE]]", 0, "Create a partition of BLOCKS "
+    "blocks allocated and SIZE blocks in size, with the passphrase on the "
+    "first line of FILE if given. Can be given more than once, instead of "
+    "--blocks and --partition-size.", 0},
+  {"fast", 'F', "FIRST[-LAST]", 0, "Place blocks FIRST to LAST of the "
+    "partition, counting from 0, on the fast devices of a tiered volume. Can "
+    "be given more than once.", 0},
   {nullptr, 0, nullptr, 0, nullptr, 0}
 };
 
+// Sizes of 0 are as large as fits
+struct NewPartition {
+  std::uint64_t blocks = 0;
+  std::uint64_t partition_size = 0;
+  // Asked for if empty
+  std::string passphrase_file;
+};
+
 struct State {
+  std::vector<NewPartition> partitions;
   std::uint64_t blocks = 0;
   std::uint64_t partition_size = 0;
-  BlockDevice device;
+  std::uint64_t run_length = 1;
+  // Ranges of partition blocks to place on fast devices, inclusive
+  std::vector<std::pair<std::uint64_t, std::uint64_t>> fast;
+  std::vector<BlockDevice> devices;
 };
 
 error_t init_parsers(int key, char* arg, argp_state* state) {
@@ -40,8 +67,46 @@ error_t init_parsers(int key, char* arg, argp_state* state) {
           argp_failure(state, 1, 0, "Partition size must be positive");
         break;
       }
+    case 'r':
+      args.run_length = std::max<std::int64_t>(from_string<std::int64_t>(arg),
+          0);
+      if (args.run_length == 0)
+        argp_failure(state, 1, 0, "Run length must be positive");
+      break;
+    case 'N': {
+        NewPartition partition;
+        std::string spec = arg;
+        auto comma = spec.find(',');
+        partition.blocks = std::max<std::int64_t>(
+            from_string<std::int64_t>(spec.substr(0, comma)), 0);
+        if (partition.blocks == 0)
+          argp_failure(state, 1, 0, "Number of blocks must be positive");
+        if (comma != std::string::npos) {
+          spec.erase(0, comma+1);
+          comma = spec.find(',');
+          auto size = from_string<std::int64_t>(spec.substr(0, comma));
+          partition.partition_size = std::max<std::int64_t>(size, 0);
+          if (size <= 0)
+            argp_failure(state, 1, 0, "Partition size must be positive");
+          if (comma != std::string::npos)
+            partition.passphrase_file = spec.substr(comma+1);
+        }
+        args.partitions.push_back(partition);
+        break;
+      }
+    case 'F': {
+        std::string range = arg;
+        auto dash = range.find('-');
+        auto first = from_string<std::int64_t>(range.substr(0, dash));
+        auto last = dash == std::string::npos ? first :
+          from_string<std::int64_t>(range.substr(dash+1));
+        if (first < 0 || last < first)
+          argp_failure(state, 1, 0, "Invalid block range %s", arg);
+        args.fast.emplace_back(first, last);
+        break;
+      }
     case ARGP_KEY_INIT:
-      state->child_inputs[0] = &args.device;
+      state->child_inputs[0] = &args.devices;
       break;
     default:
       return ARGP_ERR_UNKNOWN;
@@ -49,52 +114,98 @@ error_t init_parsers(int key, char* arg, argp_state* state) {
   return 0;
 }
 
+// The first line of file
+SecureString read_passphrase(const std::string& file) {
+  std::ifstream in(file, std::ios::binary);
+  if (!in)
+    throw std::runtime_error("can't read passphrase from " + file);
+  SecureString passphrase;
+  char c;
+  while (in.get(c) && c != '\n')
+    passphrase.push_back(c);
+  if (passphrase.empty())
+    throw std::runtime_error("no passphrase in " + file);
+  return passphrase;
+}
+
 int main(int argc, char *argv[])
   try {
     State state;
-    auto parsers = new_subparser({"device"});
+    auto parsers = new_subparser({"devices", "stats"});
     argp argp = {options, init_parsers, nullptr, doc, parsers.get(), nullptr,
       nullptr};
     argp_parse(&argp, argc, argv, 0, nullptr, &state);
 
+    if (state.partitions.empty()) {
+      state.partitions.emplace_back();
+      state.partitions.back().blocks = state.blocks;
+      state.partitions.back().partition_size = state.partition_size;
+    } else if (state.blocks || state.partition_size) {
+      std::cerr << "Error: Give the sizes of partitions with --new instead."
+        << std::endl;
+      return 1;
+    }
+
     Params params;
 
     try {
-      params.load(state.device);
+      params.load(state.devices);
     } catch(const std::exception& e) {
-      std::cerr << "Error: Header corrupt." << std::endl;
+      if (state.devices.size() > 1)
+        std::cerr << "Error: " << e.what() << "." << std::endl;
+      else
+        std::cerr << "Error: Header corrupt." << std::endl;
       return 1;
     }
-    std::uint64_t blocks = state.device.size()/params.block_size;
+    if (!state.fast.empty() && params.fast_devices == 0) {
+      std::cerr << "Error: The volume has no fast devices." << std::endl;
+      return 1;
+    }
+    BlockDevice& device = state.devices.front();
+    // Superblocks are all on the first device
+    auto bounds = params.bounds(device.size()/params.block_size);
+    std::uint64_t blocks = bounds.back();
 
     if (blocks <= 1) {
       std::cerr << "Error: No room for any partitions." << std::endl;
       return 1;
     }
 
-    std::vector<bool> allocated_blocks(blocks);
-    allocated_blocks[0] = true;
+    Allocator allocator(blocks);
+    // headers
+    for (std::size_t i = 0; i+1 < bounds.size(); i++)
+      allocator.mark(bounds[i]);
 
-    std::string passphrase;
+    SecureString passphrase;
     Pinentry pinentry;
     pinentry.SETDESC("Enter passphrases for all partitions on this volume. "
         "Enter an empty passphrase after last passphrase.");
     pinentry.SETPROMPT("Passphrase:");
     while ((passphrase = pinentry.GETPIN()) != "") {
-      Superblock superblock(params, passphrase, blocks);
+      Superblock superblock(params, passphrase, bounds[1]);
       try {
-        superblock.load(state.device);
-        for (auto block : superblock.blocks)
-          allocated_blocks[block] = true;
+        superblock.load(device);
       } catch(...) {
         pinentry.SETERROR("No partition found for that passphrase.");
+        continue;
       }
+      std::uint64_t shared = 0;
+      for (auto block : superblock.blocks) {
+        if (block >= blocks) {
+          std::cerr << "Error: A partition maps blocks past the end of the "
+            "volume. Run check on it." << std::endl;
+          return 1;
+        }
+        if (block != 0 && allocator.allocated(block))
+          shared++;
+        allocator.mark(block);
+      }
+      if (shared)
+        std::cerr << "Warning: " << shared << " blocks of a partition are "
+          "used twice. Run check on the volume." << std::endl;
     }
 
-    std::size_t free_blocks = 0;
-    for (bool allocated : allocated_blocks)
-      if (!allocated)
-        free_blocks++;
+    std::uint64_t free_blocks = allocator.free();
 
     std::cout << free_blocks << " blocks free." << std::endl;
 
@@ -103,49 +214,96 @@ int main(int argc, char *argv[])
       return 1;
     }
 
-    if (state.blocks == 0)
-      state.blocks = free_blocks;
-    if (state.partition_size == 0) {
-      decltype(state.partition_size) last;
-      state.partition_size = state.blocks;
-      do {
-        last = state.partition_size;
-        state.partition_size = state.blocks-Superblock::size_in_blocks(params,
-          state.partition_size);
-      } while (last != state.partition_size);
+    std::uint64_t blocks_required = 0;
+    for (auto& partition : state.partitions) {
+      if (partition.blocks == 0)
+        partition.blocks = free_blocks;
+      if (partition.partition_size == 0)
+        partition.partition_size = Superblock::partition_size(params,
+            partition.blocks);
+      partition.blocks = std::min(partition.blocks, partition.partition_size+
+          Superblock::size_in_blocks(params, partition.partition_size));
+      blocks_required += partition.blocks;
     }
 
-    std::uint64_t blocks_required = state.partition_size+
-      Superblock::size_in_blocks(params, state.partition_size);
-    state.blocks = std::min(state.blocks, blocks_required);
-    
-    if (state.blocks > free_blocks) {
+    if (blocks_required > free_blocks) {
       std::cerr << "Error: not enough free space." << std::endl;
       return 1;
     }
 
-    pinentry.SETDESC("Enter passphrase for the new partition.");
-    Superblock new_partition(params, pinentry.GETPIN(), blocks);
-    if (allocated_blocks[new_partition.blocks.front()]) {
-      std::cerr << "Error: superblock location already in use." << std::endl;
-      return 1;
+    auto which = [&](std::size_t i) {
+      return state.partitions.size() == 1 ? std::string("the new partition") :
+        "new partition " + std::to_string(i+1);
+    };
+    // A passphrase given twice would only ever open the first of its
+    // partitions
+    std::vector<SecureString> passphrases;
+    for (std::size_t i = 0; i < state.partitions.size(); i++) {
+      const auto& partition = state.partitions[i];
+      if (partition.passphrase_file.empty()) {
+        pinentry.SETDESC("Enter passphrase for " + which(i) + ".");
+        passphrases.push_back(pinentry.GETPIN());
+      } else {
+        passphrases.push_back(read_passphrase(partition.passphrase_file));
+      }
+      auto same = std::find(passphrases.begin(), passphrases.end()-1,
+          passphrases.back());
+      if (same != passphrases.end()-1) {
+        std::cerr << "Error: " << which(i) << " has the same passphrase as "
+          << which(same-passphrases.begin()) << "." << std::endl;
+        return 1;
+      }
+    }
+
+    // Every superblock location is claimed before any block is allocated,
+    // so that no new partition takes another's.
+    std::vector<std::unique_ptr<Superblock>> new_partitions;
+    for (std::size_t i = 0; i < state.partitions.size(); i++) {
+      const auto& partition = state.partitions[i];
+      // open would find the existing partition first, whatever location the
+      // new one got
+      try {
+        Superblock(params, passphrases[i], bounds[1]).load(device);
+        std::cerr << "Error: The passphrase for " << which(i)
+          << " already opens a partition." << std::endl;
+        return 1;
+      } catch(const NoSuperblock&) {
+      } catch(const std::exception& e) {
+        std::cerr << "Error: Can't tell whether the passphrase for " << which(i)
+          << " opens a partition already: " << e.what() << "." << std::endl;
+        return 1;
+      }
+      new_partitions.emplace_back(new Superblock(params, passphrases[i],
+            bounds[1]));
+      Superblock& new_partition = *new_partitions.back();
+      if (!claim_location(allocator, new_partition)) {
+        std::cerr << "Error: every superblock location of " << which(i)
+          << " is already in use." << std::endl;
+        return 1;
+      }
+      if (partition.blocks < Superblock::size_in_blocks(params,
+            partition.partition_size)) {
+        std::cerr << "Error: not enough blocks for the header of " << which(i)
+          << "." << std::endl;
+        return 1;
+      }
     }
-    allocated_blocks[new_partition.blocks.front()] = true;
-    state.blocks--;
-
-    std::vector<std::uint64_t> pool;
-    pool.reserve(free_blocks-1);
-    for (std::size_t i = 0; i < blocks; i++)
-      if (!allocated_blocks[i])
-        pool.push_back(i);
-    std::shuffle(pool.begin(), pool.end(), std::random_device());
-    for (; state.blocks > 0; state.blocks--, state.partition_size--) {
-      new_partition.blocks.push_back(pool.back());
-      pool.pop_back();
+
+    for (std::size_t i = 0; i < state.partitions.size(); i++) {
+      const auto& partition = state.partitions[i];
+      Superblock& new_partition = *new_partitions[i];
+      std::uint64_t data_blocks = partition.blocks-
+        Superblock::size_in_blocks(params, partition.partition_size);
+      std::vector<bool> fast(data_blocks, false);
+      for (const auto& range : state.fast)
+        for (auto j = range.first; j <= range.second && j < data_blocks; j++)
+          fast[j] = true;
+      lay_out(allocator, bounds, new_partition, partition.blocks,
+          partition.partition_size, state.run_length, fast);
     }
-    for (; state.partition_size > 0; state.partition_size--)
-      new_partition.blocks.push_back(0);
-    new_partition.store(state.device);
+
+    for (auto& new_partition : new_partitions)
+      new_partition->store(device);
     return 0;
   } catch(const std::exception& e) {
     std::cerr << "Error: " << e.what() << std::endl;
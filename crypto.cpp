@@ -1,29 +1,41 @@
 #include "crypto.h"
 #include "util.h"
+#include <algorithm>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <stdexcept>
 
 namespace {
+  // Locked if RLIMIT_MEMLOCK allows, which libgcrypt warns about otherwise.
+  // Room for the keys of several hundred open partitions.
+  const unsigned SECMEM_SIZE = 1 << 20;
+
   static struct libgcrypt {
     libgcrypt() {
       if (!gcry_check_version(GCRYPT_VERSION)) {
         std::cerr << "libgcrypt version mismatch" << std::endl;
         std::exit(2);
       }
-      gcry_control(GCRYCTL_DISABLE_SECMEM, 0);
+      gcry_control(GCRYCTL_INIT_SECMEM, SECMEM_SIZE, 0);
       gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
     }
   } libgcrypt;
 }
 
-Hash::Hash(int algo) {
-  gpg_error_t error;
-  if ((error = gcry_md_open(&_handle, algo, 0)) != GPG_ERR_NO_ERROR)
+// Handles that don't fit in secure memory any more fall back to ordinary
+// memory, which libgcrypt still wipes when they are closed.
+Hash::Hash(int algo, bool secure) {
+  gpg_error_t error = gcry_md_open(&_handle, algo,
+      secure ? GCRY_MD_FLAG_SECURE : 0);
+  if (secure && gpg_err_code(error) == GPG_ERR_ENOMEM)
+    error = gcry_md_open(&_handle, algo, 0);
+  if (error != GPG_ERR_NO_ERROR)
     throw std::system_error(gcrypt_error_code(error), gpg_category());
 }
 
-Hash::Hash(const std::string& name)
-    : Hash(gcry_md_map_name(name.c_str())) {
+Hash::Hash(const std::string& name, bool secure)
+    : Hash(gcry_md_map_name(name.c_str()), secure) {
 }
 
 Hash::Hash(const Hash& hash) {
@@ -73,7 +85,15 @@ void Hash::reset() {
 }
 
 void Hash::update(const std::string& data) {
-  gcry_md_write(_handle, data.data(), data.size());
+  update(data.data(), data.size());
+}
+
+void Hash::update(const SecureString& data) {
+  update(data.data(), data.size());
+}
+
+void Hash::update(const void* data, std::size_t n) {
+  gcry_md_write(_handle, data, n);
 }
 
 std::string Hash::digest() {
@@ -81,20 +101,27 @@ std::string Hash::digest() {
   return std::string(reinterpret_cast<char*>(gcry_md_read(_handle, 0)), size());
 }
 
-Symmetric::Symmetric(int algo)
-    : _algo(algo) {
-  gpg_error_t error;
-  if ((error = gcry_cipher_open(&_handle, algo, GCRY_CIPHER_MODE_CBC, 0))
-      != GPG_ERR_NO_ERROR)
+void Hash::digest(void* out) {
+  gcry_md_final(_handle);
+  std::memcpy(out, gcry_md_read(_handle, 0), size());
+}
+
+Symmetric::Symmetric(int algo, int mode, bool secure)
+    : _algo(algo), _mode(mode) {
+  gpg_error_t error = gcry_cipher_open(&_handle, algo, mode,
+      secure ? GCRY_CIPHER_SECURE : 0);
+  if (secure && gpg_err_code(error) == GPG_ERR_ENOMEM)
+    error = gcry_cipher_open(&_handle, algo, mode, 0);
+  if (error != GPG_ERR_NO_ERROR)
     throw std::system_error(gcrypt_error_code(error), gpg_category());
 }
 
-Symmetric::Symmetric(const std::string& name)
-    : Symmetric(gcry_cipher_map_name(name.c_str())) {
+Symmetric::Symmetric(const std::string& name, int mode, bool secure)
+    : Symmetric(gcry_cipher_map_name(name.c_str()), mode, secure) {
 }
 
 Symmetric::Symmetric(Symmetric&& cipher)
-    : _handle(cipher._handle) {
+    : _handle(cipher._handle), _algo(cipher._algo), _mode(cipher._mode) {
   cipher._handle = nullptr;
 }
 
@@ -104,9 +131,19 @@ Symmetric::~Symmetric() {
 
 Symmetric& Symmetric::operator=(Symmetric&& cipher) {
   std::swap(_handle, cipher._handle);
+  std::swap(_algo, cipher._algo);
+  std::swap(_mode, cipher._mode);
   return *this;
 }
 
+int Symmetric::mode() {
+  return _mode;
+}
+
+bool Symmetric::aead() {
+  return _mode == GCRY_CIPHER_MODE_GCM || _mode == GCRY_CIPHER_MODE_OCB;
+}
+
 std::size_t Symmetric::key_size() {
   return gcry_cipher_get_algo_keylen(_algo);
 }
@@ -115,25 +152,47 @@ std::size_t Symmetric::block_size() {
   return gcry_cipher_get_algo_blklen(_algo);
 }
 
+std::size_t Symmetric::tag_size() {
+  return aead() ? 16 : 0;
+}
+
 void Symmetric::set_key(const std::string& key) {
+  set_key(key.data(), key.size());
+}
+
+void Symmetric::set_key(const void* key, std::size_t n) {
   gpg_error_t error;
-  if ((error = gcry_cipher_setkey(_handle, key.data(), key.size()))
+  if ((error = gcry_cipher_setkey(_handle, key, n))
       != GPG_ERR_NO_ERROR)
     throw std::system_error(gcrypt_error_code(error), gpg_category());
 }
 
 void Symmetric::set_iv(const std::string& iv) {
+  set_iv(iv.data(), iv.size());
+}
+
+void Symmetric::set_iv(const void* iv, std::size_t n) {
   gpg_error_t error;
-  if ((error = gcry_cipher_setiv(_handle, iv.data(), iv.size()))
+  if ((error = gcry_cipher_setiv(_handle, iv, n)) != GPG_ERR_NO_ERROR)
+    throw std::system_error(gcrypt_error_code(error), gpg_category());
+}
+
+void Symmetric::set_ctr(const std::string& ctr) {
+  gpg_error_t error;
+  if ((error = gcry_cipher_setctr(_handle, ctr.data(), ctr.size()))
       != GPG_ERR_NO_ERROR)
     throw std::system_error(gcrypt_error_code(error), gpg_category());
 }
 
 void Symmetric::reset(const std::string& iv) {
+  reset(iv.data(), iv.size());
+}
+
+void Symmetric::reset(const void* iv, std::size_t n) {
   gpg_error_t error;
   if ((error = gcry_cipher_reset(_handle)) != GPG_ERR_NO_ERROR)
     throw std::system_error(gcrypt_error_code(error), gpg_category());
-  set_iv(iv);
+  set_iv(iv, n);
 }
 
 std::string Symmetric::encrypt(const std::string& data) {
@@ -162,6 +221,94 @@ std::string Symmetric::decrypt(const std::string& data) {
   return ret;
 }
 
+void Symmetric::encrypt(void* buf, std::size_t n) {
+  gpg_error_t error;
+  if ((error = gcry_cipher_encrypt(_handle, buf, n, nullptr, 0))
+      != GPG_ERR_NO_ERROR)
+    throw std::system_error(gcrypt_error_code(error), gpg_category());
+}
+
+void Symmetric::decrypt(void* buf, std::size_t n) {
+  gpg_error_t error;
+  if ((error = gcry_cipher_decrypt(_handle, buf, n, nullptr, 0))
+      != GPG_ERR_NO_ERROR)
+    throw std::system_error(gcrypt_error_code(error), gpg_category());
+}
+
+void Symmetric::authenticate(const std::string& data) {
+  authenticate(data.data(), data.size());
+}
+
+void Symmetric::authenticate(const void* data, std::size_t n) {
+  gpg_error_t error;
+  if ((error = gcry_cipher_authenticate(_handle, data, n))
+      != GPG_ERR_NO_ERROR)
+    throw std::system_error(gcrypt_error_code(error), gpg_category());
+}
+
+void Symmetric::final() {
+  gpg_error_t error;
+  if ((error = gcry_cipher_final(_handle)) != GPG_ERR_NO_ERROR)
+    throw std::system_error(gcrypt_error_code(error), gpg_category());
+}
+
+std::string Symmetric::tag() {
+  gpg_error_t error;
+  std::string ret(tag_size(), '\x00');
+  if ((error = gcry_cipher_gettag(_handle, &ret[0], ret.size()))
+      != GPG_ERR_NO_ERROR)
+    throw std::system_error(gcrypt_error_code(error), gpg_category());
+  return ret;
+}
+
+bool Symmetric::check_tag(const std::string& tag) {
+  gpg_error_t error = gcry_cipher_checktag(_handle, tag.data(), tag.size());
+  if (gpg_err_code(error) == GPG_ERR_CHECKSUM)
+    return false;
+  if (error != GPG_ERR_NO_ERROR)
+    throw std::system_error(gcrypt_error_code(error), gpg_category());
+  return true;
+}
+
+RandomStream::RandomStream()
+    : _cipher(GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_CTR) {
+  _cipher.set_key(nonce(_cipher.key_size()));
+  _cipher.set_ctr(nonce(_cipher.block_size()));
+}
+
+void RandomStream::fill(void* buf, std::size_t n) {
+  // Encrypt zeroes a piece at a time so that each piece is still in cache
+  // when it's encrypted.
+  const std::size_t PIECE = 64 << 10;
+  char* p = reinterpret_cast<char*>(buf);
+  for (std::size_t done = 0; done < n; done += PIECE) {
+    std::size_t size = std::min(PIECE, n-done);
+    std::memset(p+done, 0, size);
+    _cipher.encrypt(p+done, size);
+  }
+}
+
+std::string RandomStream::bytes(std::size_t n) {
+  std::string ret(n, '\x00');
+  fill(&ret[0], n);
+  return ret;
+}
+
+std::uint64_t RandomStream::uniform(std::uint64_t bound) {
+  // Reject the top partial range so that every residue is equally likely
+  std::uint64_t limit = -bound % bound;
+  std::uint64_t ret;
+  do {
+    if (_used == _buffer.size()) {
+      _buffer.resize(512);
+      fill(_buffer.data(), _buffer.size()*sizeof(_buffer[0]));
+      _used = 0;
+    }
+    ret = _buffer[_used++];
+  } while (ret < limit);
+  return ret % bound;
+}
+
 std::vector<std::string> hash_functions() {
   int num;
   gpg_error_t error;
@@ -202,3 +349,23 @@ std::vector<std::string> block_ciphers() {
   return ret;
 }
 
+std::vector<std::string> cipher_modes() {
+  return {"CBC", "GCM", "OCB"};
+}
+
+int cipher_mode(const std::string& name) {
+  if (name.empty() || name == "CBC")
+    return GCRY_CIPHER_MODE_CBC;
+  if (name == "GCM")
+    return GCRY_CIPHER_MODE_GCM;
+  if (name == "OCB")
+    return GCRY_CIPHER_MODE_OCB;
+  throw std::invalid_argument("unknown cipher mode: " + name);
+}
+
+std::size_t hash_size(const std::string& name) {
+  std::size_t size = gcry_md_get_algo_dlen(gcry_md_map_name(name.c_str()));
+  if (size == 0)
+    throw std::invalid_argument("unknown hash function: " + name);
+  return size;
+}
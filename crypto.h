@@ -2,15 +2,139 @@
 #define CRYPTO_H_
 
 #include <gcrypt.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
 #include <cassert>
 
+// Allocates from libgcrypt's secure memory, which is locked into RAM where
+// permitted, and from ordinary memory once that runs out. Either way memory
+// is wiped when freed. Meant for passphrases and keys, which are few and
+// small.
+template <class T> struct SecureAllocator {
+  typedef T value_type;
+
+  SecureAllocator() = default;
+  template <class U> SecureAllocator(const SecureAllocator<U>&) {
+  }
+
+  T* allocate(std::size_t n) {
+    void* p = gcry_malloc_secure(n*sizeof(T));
+    if (!p)
+      p = gcry_malloc(n*sizeof(T));
+    if (!p)
+      throw std::bad_alloc();
+    return static_cast<T*>(p);
+  }
+
+  void deallocate(T* p, std::size_t n) {
+    volatile char* bytes = reinterpret_cast<volatile char*>(p);
+    for (std::size_t i = 0; i < n*sizeof(T); i++)
+      bytes[i] = 0;
+    gcry_free(p);
+  }
+};
+
+template <class T, class U>
+bool operator==(const SecureAllocator<T>&, const SecureAllocator<U>&) {
+  return true;
+}
+
+template <class T, class U>
+bool operator!=(const SecureAllocator<T>&, const SecureAllocator<U>&) {
+  return false;
+}
+
+// The subset of std::string used for passphrases and keys. Unlike a
+// std::string it never keeps characters inside the object itself, where they
+// would be neither locked nor wiped, however short they are.
+class SecureString {
+  typedef std::vector<char, SecureAllocator<char>> Data;
+
+ public:
+  typedef char value_type;
+  typedef std::size_t size_type;
+  typedef Data::iterator iterator;
+  typedef Data::const_iterator const_iterator;
+  static const size_type npos = std::string::npos;
+
+  SecureString() = default;
+  SecureString(size_type n, char c) : _data(n, c) {
+  }
+  SecureString(const char* s) : SecureString(s, std::strlen(s)) {
+  }
+  SecureString(const char* s, size_type n) : _data(s, s+n) {
+  }
+  SecureString(const SecureString& s, size_type pos, size_type n = npos) {
+    assign(s, pos, n);
+  }
+  template <class Iterator> SecureString(Iterator first, Iterator last)
+      : _data(first, last) {
+  }
+
+  size_type size() const { return _data.size(); }
+  bool empty() const { return _data.empty(); }
+  const char* data() const { return _data.data(); }
+  char& operator[](size_type i) { return _data[i]; }
+  const char& operator[](size_type i) const { return _data[i]; }
+  iterator begin() { return _data.begin(); }
+  iterator end() { return _data.end(); }
+  const_iterator begin() const { return _data.begin(); }
+  const_iterator end() const { return _data.end(); }
+
+  void clear() { _data.clear(); }
+  void resize(size_type n, char c = '\0') { _data.resize(n, c); }
+  void reserve(size_type n) { _data.reserve(n); }
+  void push_back(char c) { _data.push_back(c); }
+
+  SecureString& assign(const char* s, size_type n) {
+    _data.assign(s, s+n);
+    return *this;
+  }
+  SecureString& assign(const SecureString& s, size_type pos,
+      size_type n = npos) {
+    if (pos > s.size())
+      throw std::out_of_range("SecureString::assign");
+    return assign(s.data()+pos, std::min(n, s.size()-pos));
+  }
+  SecureString& append(const char* s, size_type n) {
+    _data.insert(_data.end(), s, s+n);
+    return *this;
+  }
+  SecureString& operator+=(const SecureString& s) {
+    return append(s.data(), s.size());
+  }
+  SecureString substr(size_type pos = 0, size_type n = npos) const {
+    return SecureString(*this, pos, n);
+  }
+
+  // Takes the same time wherever strings of the same size differ
+  friend bool operator==(const SecureString& a, const SecureString& b) {
+    if (a.size() != b.size())
+      return false;
+    volatile unsigned char diff = 0;
+    for (size_type i = 0; i < a.size(); i++)
+      diff = diff | (a[i] ^ b[i]);
+    return diff == 0;
+  }
+  friend bool operator!=(const SecureString& a, const SecureString& b) {
+    return !(a == b);
+  }
+
+ private:
+  Data _data;
+};
+
 class Hash {
  public:
-  explicit Hash(int algo);
-  explicit Hash(const std::string& name);
+  // Secure handles keep their state in secure memory, for hashing secrets
+  explicit Hash(int algo, bool secure = false);
+  explicit Hash(const std::string& name, bool secure = false);
   Hash(const Hash&);
   Hash(Hash&&);
   ~Hash();
@@ -23,7 +147,11 @@ class Hash {
 
   void reset();
   void update(const std::string&);
+  void update(const SecureString&);
+  void update(const void* data, std::size_t n);
   std::string digest();
+  // Writes size() bytes to out
+  void digest(void* out);
 
  private:
   gcry_md_hd_t _handle;
@@ -31,36 +159,84 @@ class Hash {
 
 class Symmetric {
  public:
-  explicit Symmetric(int algo);
-  explicit Symmetric(const std::string& name);
+  // Secure handles keep the key schedule in secure memory
+  explicit Symmetric(int algo, int mode = GCRY_CIPHER_MODE_CBC,
+      bool secure = false);
+  explicit Symmetric(const std::string& name,
+      int mode = GCRY_CIPHER_MODE_CBC, bool secure = false);
   Symmetric(const Symmetric&) = delete;
   Symmetric(Symmetric&&);
   ~Symmetric();
   Symmetric& operator=(const Symmetric&) = delete;
   Symmetric& operator=(Symmetric&&);
 
+  int mode();
+  bool aead();
   std::size_t key_size();
   std::size_t block_size();
+  std::size_t tag_size();
 
   void set_key(const std::string&);
+  void set_key(const void* key, std::size_t n);
   void set_iv(const std::string&);
+  void set_iv(const void* iv, std::size_t n);
+  void set_ctr(const std::string&);
 
   void reset(const std::string& iv);
+  void reset(const void* iv, std::size_t n);
   std::string encrypt(const std::string&);
   std::string decrypt(const std::string&);
+  void encrypt(void* buf, std::size_t n);
+  void decrypt(void* buf, std::size_t n);
+
+  // AEAD modes only
+  void authenticate(const std::string&);
+  void authenticate(const void* data, std::size_t n);
+  void final();
+  std::string tag();
+  bool check_tag(const std::string&);
 
  private:
   gcry_cipher_hd_t _handle;
-  int _algo;
+  int _algo, _mode;
 };
 
 static inline std::string nonce(std::size_t n) {
-  unsigned char buf[n];
-  gcry_create_nonce(buf, n);
-  return std::string(reinterpret_cast<char*>(buf), n);
+  std::string ret(n, '\x00');
+  gcry_create_nonce(&ret[0], n);
+  return ret;
+}
+
+// Key material from the strong random pool
+static inline SecureString random_key(std::size_t n) {
+  SecureString ret(n, '\x00');
+  gcry_randomize(&ret[0], n, GCRY_STRONG_RANDOM);
+  return ret;
 }
 
+// AES-256 keystream in CTR mode, keyed from the nonce generator. Meant for
+// bulk data that only has to be indistinguishable from ciphertext, such as
+// padding; use nonce() for anything that is itself secret.
+class RandomStream {
+ public:
+  RandomStream();
+
+  void fill(void* buf, std::size_t n);
+  std::string bytes(std::size_t n);
+  // Uniformly distributed in [0, bound)
+  std::uint64_t uniform(std::uint64_t bound);
+
+ private:
+  Symmetric _cipher;
+  std::vector<std::uint64_t> _buffer;
+  std::size_t _used = 0;
+};
+
 std::vector<std::string> hash_functions();
 std::vector<std::string> block_ciphers();
+std::vector<std::string> cipher_modes();
+int cipher_mode(const std::string& name);
+// Digest size of a hash function, without opening a handle
+std::size_t hash_size(const std::string& name);
  
 #endif  // CRYPTO_H_
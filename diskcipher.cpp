@@ -0,0 +1,86 @@
+#include "diskcipher.h"
+#include <algorithm>
+#include <cctype>
+#include <stdexcept>
+
+static const std::size_t SECTOR_SIZE = 512;
+
+// libgcrypt names some ciphers after their key size and some not
+static int cipher_algo(const std::string& name, std::size_t key_size) {
+  std::string upper = name;
+  std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+  for (auto candidate : {upper + std::to_string(key_size*8), upper}) {
+    int algo = gcry_cipher_map_name(candidate.c_str());
+    if (algo != 0 && gcry_cipher_get_algo_keylen(algo) == key_size)
+      return algo;
+  }
+  throw std::invalid_argument("unsupported cipher " + name + " with " +
+      std::to_string(key_size*8) + "-bit key");
+}
+
+DiskCipher::DiskCipher(const std::string& spec, const SecureString& key) {
+  std::size_t first = spec.find('-'), second = spec.find('-', first+1);
+  if (first == std::string::npos || second == std::string::npos)
+    throw std::invalid_argument("unsupported disk cipher " + spec);
+  std::string name = spec.substr(0, first);
+  std::string chain = spec.substr(first+1, second-first-1);
+  std::string iv = spec.substr(second+1);
+
+  if (chain == "cbc") {
+    _cipher.reset(new Symmetric(cipher_algo(name, key.size()),
+          GCRY_CIPHER_MODE_CBC, true));
+  } else if (chain == "xts") {
+    // Two keys of the same size
+    _cipher.reset(new Symmetric(cipher_algo(name, key.size()/2),
+          GCRY_CIPHER_MODE_XTS, true));
+  } else {
+    throw std::invalid_argument("unsupported disk cipher mode " + chain);
+  }
+  _cipher->set_key(key.data(), key.size());
+
+  if (iv == "plain") {
+    _iv_mode = IV_PLAIN;
+  } else if (iv == "plain64") {
+    _iv_mode = IV_PLAIN64;
+  } else if (iv.compare(0, 6, "essiv:") == 0) {
+    // IVs are sector numbers encrypted under the hash of the key
+    _iv_mode = IV_ESSIV;
+    Hash hash(iv.substr(6), true);
+    hash.update(key);
+    SecureString salt(hash.size(), '\x00');
+    hash.digest(&salt[0]);
+    _essiv.reset(new Symmetric(cipher_algo(name, salt.size()),
+          GCRY_CIPHER_MODE_ECB, true));
+    _essiv->set_key(salt.data(), salt.size());
+  } else {
+    throw std::invalid_argument("unsupported disk cipher IV " + iv);
+  }
+}
+
+void DiskCipher::set_iv(std::uint64_t sector) {
+  // Little-endian sector number, padded with zeroes to the block size
+  unsigned char iv[32] = {};
+  std::size_t size = _cipher->block_size();
+  std::size_t width = _iv_mode == IV_PLAIN ? 4 : 8;
+  for (std::size_t i = 0; i < width; i++)
+    iv[i] = sector >> (8*i);
+  if (_iv_mode == IV_ESSIV)
+    _essiv->encrypt(iv, size);
+  _cipher->set_iv(iv, size);
+}
+
+void DiskCipher::encrypt(void* buf, std::size_t n, std::uint64_t sector) {
+  char* p = static_cast<char*>(buf);
+  for (std::size_t done = 0; done < n; done += SECTOR_SIZE, sector++) {
+    set_iv(sector);
+    _cipher->encrypt(p+done, SECTOR_SIZE);
+  }
+}
+
+void DiskCipher::decrypt(void* buf, std::size_t n, std::uint64_t sector) {
+  char* p = static_cast<char*>(buf);
+  for (std::size_t done = 0; done < n; done += SECTOR_SIZE, sector++) {
+    set_iv(sector);
+    _cipher->decrypt(p+done, SECTOR_SIZE);
+  }
+}
@@ -0,0 +1,29 @@
+#ifndef DISKCIPHER_H_
+#define DISKCIPHER_H_
+
+#include "crypto.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// Userspace implementation of dm-crypt, for ciphers given the way dm-crypt
+// takes them: cipher-chainmode-ivmode[:ivopts], where chainmode is cbc or xts
+// and ivmode is plain, plain64 or essiv:HASH. Sectors are 512 bytes.
+class DiskCipher {
+ public:
+  DiskCipher(const std::string& spec, const SecureString& key);
+
+  // n is a multiple of 512, and sector the IV sector of the first one
+  void encrypt(void* buf, std::size_t n, std::uint64_t sector);
+  void decrypt(void* buf, std::size_t n, std::uint64_t sector);
+
+ private:
+  enum IVMode { IV_PLAIN, IV_PLAIN64, IV_ESSIV };
+
+  void set_iv(std::uint64_t sector);
+
+  std::unique_ptr<Symmetric> _cipher, _essiv;
+  IVMode _iv_mode;
+};
+
+#endif  // DISKCIPHER_H_
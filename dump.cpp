@@ -0,0 +1,205 @@
+#include "blockdevice.h"
+#include "diskcipher.h"
+#include "header.h"
+#include "pinentry.h"
+#include "argp-parsers.h"
+#include <argp.h>
+#include <algorithm>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+const char* doc = "Write the decrypted contents of a partition on DEVICE to "
+  "standard output\vThis needs neither device-mapper nor root, only read "
+  "access to DEVICE, which can also be an image of a volume. Unmapped "
+  "parts of the partition are written as zeroes.";
+
+argp_option options[] = {
+  {"output", 'o', "FILE", 0, "Write to FILE instead of standard output", 0},
+  {"threads", 'j', "N", 0, "Number of threads decrypting blocks", 0},
+  {"readahead", 'a', "BLOCKS", 0, "Number of blocks read ahead of the output"
+    , 0},
+  {nullptr, 0, nullptr, 0, nullptr, 0}
+};
+
+struct State {
+  BlockDevice device;
+  std::string output;
+  unsigned threads = std::max(std::thread::hardware_concurrency(), 1u);
+  std::size_t readahead = 0;
+};
+
+error_t init_parsers(int key, char* arg, argp_state* state) {
+  State& args = *reinterpret_cast<State*>(state->input);
+  switch (key) {
+    case 'o':
+      args.output = arg;
+      break;
+    case 'j':
+      args.threads = std::max<std::int64_t>(from_string<std::int64_t>(arg), 0);
+      if (args.threads == 0)
+        argp_failure(state, 1, 0, "Number of threads must be positive");
+      break;
+    case 'a':
+      args.readahead = std::max<std::int64_t>(from_string<std::int64_t>(arg),
+          0);
+      if (args.readahead == 0)
+        argp_failure(state, 1, 0, "Readahead must be positive");
+      break;
+    case ARGP_KEY_INIT:
+      state->child_inputs[0] = &args.device;
+      break;
+    default:
+      return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[])
+  try {
+    State state;
+    auto parsers = new_subparser({"readonly-device", "stats"});
+    argp argp = {options, init_parsers, nullptr, doc, parsers.get(), nullptr,
+      nullptr};
+    argp_parse(&argp, argc, argv, 0, nullptr, &state);
+
+    Params params;
+
+    try {
+      params.load(state.device);
+    } catch(const std::exception& e) {
+      std::cerr << "Error: Header corrupt." << std::endl;
+      return 1;
+    }
+    if (!params.devices.empty()) {
+      std::cerr << "Error: Volumes on several devices aren't supported by "
+        "this tool yet." << std::endl;
+      return 1;
+    }
+    std::uint64_t blocks = state.device.size()/params.block_size;
+
+    Pinentry pinentry;
+    pinentry.SETDESC("Enter passphrase for the partition to dump.");
+    pinentry.SETPROMPT("Passphrase:");
+    auto passphrase = pinentry.GETPIN();
+    Superblock superblock(params, passphrase, blocks);
+    try {
+      superblock.load(state.device);
+    } catch(...) {
+      std::cerr << "Error: No partition found for that passphrase." << std::endl;
+      return 1;
+    }
+    SecureString key = superblock.disk_key.empty() ?
+      params.disk_key(passphrase) : superblock.disk_key;
+    std::string cipher = superblock.device_cipher.empty() ?
+      params.device_cipher : superblock.device_cipher;
+    // Fail early on ciphers there is no userspace implementation of
+    DiskCipher check(cipher, key);
+    if (!superblock.next_key.empty())
+      DiskCipher check_next(superblock.next_cipher, superblock.next_key);
+
+    std::ofstream file;
+    if (!state.output.empty()) {
+      file.open(state.output, std::ios::binary | std::ios::trunc);
+      if (!file)
+        throw std::runtime_error("can't open " + state.output);
+    }
+    std::ostream& out = state.output.empty() ? std::cout : file;
+
+    // Blocks are decrypted in parallel into a ring of slots, and written out
+    // in order as soon as the next one is ready.
+    std::size_t offset = superblock.offset;
+    std::size_t count = superblock.blocks.size()-offset;
+    std::size_t slots = state.readahead ? state.readahead : 2*state.threads;
+    std::vector<std::unique_ptr<char[]>> buffers;
+    for (std::size_t i = 0; i < slots; i++)
+      buffers.emplace_back(new char[params.block_size]);
+    std::vector<bool> ready(slots, false);
+    std::size_t next = 0, written = 0;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::exception_ptr error;
+
+    auto worker = [&]() {
+      try {
+        DiskCipher current(cipher, key);
+        std::unique_ptr<DiskCipher> reencrypted;
+        if (!superblock.next_key.empty())
+          reencrypted.reset(new DiskCipher(superblock.next_cipher,
+                superblock.next_key));
+        while (true) {
+          std::size_t i;
+          {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [&]() {
+              return error || next >= count || next < written+slots;
+            });
+            if (error || next >= count)
+              return;
+            i = next++;
+          }
+          char* buf = buffers[i%slots].get();
+          std::uint64_t block = superblock.blocks[offset+i];
+          if (block == 0) {
+            std::memset(buf, 0, params.block_size);
+          } else {
+            state.device.pread(buf, params.block_size,
+                block*params.block_size);
+            std::uint64_t sector = superblock.logical_iv ?
+              i*params.block_size/512 : 0;
+            (reencrypted && i < superblock.reencrypted ? *reencrypted :
+             current).decrypt(buf, params.block_size, sector);
+          }
+          std::lock_guard<std::mutex> lock(mutex);
+          ready[i%slots] = true;
+          changed.notify_all();
+        }
+      } catch(...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!error)
+          error = std::current_exception();
+        changed.notify_all();
+      }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < state.threads; i++)
+      threads.emplace_back(worker);
+    try {
+      while (written < count) {
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          changed.wait(lock, [&]() { return error || ready[written%slots]; });
+          if (error)
+            break;
+        }
+        out.write(buffers[written%slots].get(), params.block_size);
+        if (!out)
+          throw std::runtime_error("write failed");
+        std::lock_guard<std::mutex> lock(mutex);
+        ready[written%slots] = false;
+        written++;
+        changed.notify_all();
+      }
+    } catch(...) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!error)
+        error = std::current_exception();
+      changed.notify_all();
+    }
+    for (auto& thread : threads)
+      thread.join();
+    if (error)
+      std::rethrow_exception(error);
+    out.flush();
+    return 0;
+  } catch(const std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
@@ -0,0 +1,112 @@
+#include "fill.h"
+#include "crypto.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+// Size of every write, and the alignment direct I/O needs
+static const std::size_t PIECE_SIZE = 8 << 20;
+static const std::size_t ALIGNMENT = 4096;
+
+RandomFill::RandomFill(BlockDevice& device, unsigned threads)
+  : _device(device), _threads(std::max(threads, 1u)) {
+}
+
+void RandomFill::fill(std::uint64_t begin, std::uint64_t end,
+    const std::function<void(std::uint64_t)>& progress) {
+  // Direct I/O keeps the page cache out of the way, for all but an unaligned
+  // tail. Devices that don't support it are written through the cache.
+  std::uint64_t direct_end = std::max(begin, end & ~(ALIGNMENT-1));
+  bool direct = begin % ALIGNMENT == 0;
+  if (direct) {
+    try {
+      _device.direct(true);
+    } catch(const std::system_error&) {
+      direct = false;
+    }
+  }
+  if (!direct)
+    direct_end = end;
+
+  std::uint64_t pieces = (direct_end-begin+PIECE_SIZE-1)/PIECE_SIZE;
+  std::atomic<std::uint64_t> next(0);
+  // Pieces are written out of order; written counts those below which all
+  // are done.
+  std::mutex mutex;
+  std::condition_variable finished;
+  std::set<std::uint64_t> done;
+  std::uint64_t written = 0;
+  unsigned running = _threads;
+  std::exception_ptr error;
+
+  auto worker = [&]() {
+    try {
+      RandomStream random;
+      void* p;
+      if (posix_memalign(&p, ALIGNMENT, PIECE_SIZE) != 0)
+        throw std::bad_alloc();
+      std::unique_ptr<char, void(*)(void*)> buf(static_cast<char*>(p),
+          std::free);
+      std::uint64_t i;
+      while ((i = next++) < pieces) {
+        std::uint64_t offset = begin+i*PIECE_SIZE;
+        std::size_t n = std::min<std::uint64_t>(PIECE_SIZE,
+            direct_end-offset);
+        random.fill(buf.get(), n);
+        _device.pwrite(buf.get(), n, offset);
+        std::lock_guard<std::mutex> lock(mutex);
+        done.insert(i);
+        while (!done.empty() && *done.begin() == written) {
+          done.erase(done.begin());
+          written++;
+        }
+      }
+    } catch(...) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!error)
+        error = std::current_exception();
+      // Make the other threads stop after their current piece
+      next = pieces;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    if (--running == 0)
+      finished.notify_all();
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned i = 0; i < _threads; i++)
+    threads.emplace_back(worker);
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!finished.wait_for(lock, std::chrono::seconds(1),
+          [&]() { return running == 0; })) {
+      std::uint64_t offset = std::min(begin+written*PIECE_SIZE, direct_end);
+      lock.unlock();
+      progress(offset);
+      lock.lock();
+    }
+  }
+  for (auto& thread : threads)
+    thread.join();
+  if (direct)
+    _device.direct(false);
+  if (error)
+    std::rethrow_exception(error);
+
+  if (direct_end < end) {
+    RandomStream random;
+    std::string tail = random.bytes(end-direct_end);
+    _device.pwrite(tail.data(), tail.size(), direct_end);
+  }
+  _device.sync();
+  progress(end);
+}
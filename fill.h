@@ -0,0 +1,24 @@
+#ifndef FILL_H_
+#define FILL_H_
+
+#include "blockdevice.h"
+#include <cstdint>
+#include <functional>
+
+// Overwrites a device with random data, generating an AES-CTR keystream on
+// every thread and writing it in large aligned pieces.
+class RandomFill {
+ public:
+  RandomFill(BlockDevice& device, unsigned threads);
+
+  // Fills bytes begin to end of the device. progress is called about once a
+  // second with the offset below which everything has been written.
+  void fill(std::uint64_t begin, std::uint64_t end,
+      const std::function<void(std::uint64_t)>& progress);
+
+ private:
+  BlockDevice& _device;
+  unsigned _threads;
+};
+
+#endif  // FILL_H_
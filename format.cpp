@@ -1,44 +1,149 @@
 #include "argp-parsers.h"
 #include "PBKDF2.h"
 #include "crypto.h"
+#include "fill.h"
 #include "header.h"
 #include "util.h"
 
 #include <argp.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <thread>
 #include "blockdevice.h"
 
-const char* static_doc = "Create an encrypted volume on DEVICE\v\
+const char* static_doc = "Create an encrypted volume on DEVICE, or across \
+every DEVICE given with partitions striped across them\v\
 Default block size: 4194304 bytes or 4 MiB\n\
+Default header chunk size: 65536 bytes or 64 KiB\n\
 Default disk cipher: aes-cbc-essiv:sha256\n\
 Default disk encryption key length: 256 bits\n\
 Default header cipher: AES256\n\
+Default header cipher mode: GCM\n\
 Default hash algorithm: SHA256\n\
-Default PBKDF2 iteration time: 1000 ms or one second";
+Default PBKDF2 iteration time: 1000 ms or one second\n\
+Default number of fill threads: one per CPU";
+
+argp_option options[] = {
+  {"fill", 'f', nullptr, 0, "Overwrite DEVICE with random data first, so "
+    "that free blocks can't be told apart from used ones", 0},
+  {"checkpoint", 'p', "FILE", 0, "Record the progress of --fill in FILE, and "
+    "resume from it if it exists. Only for a single DEVICE.", 0},
+  {"threads", 'j', "N", 0, "Number of threads to fill DEVICE with", 0},
+  {"fast", 'F', "N", 0, "The first N of several DEVICEs are faster than the "
+    "rest, and hold the blocks partitions are created to keep on fast "
+    "storage", 0},
+  {nullptr, 0, nullptr, 0, nullptr, 0}
+};
 
 struct State {
   Params params;
-  BlockDevice device;
+  std::vector<BlockDevice> devices;
+  bool fill = false;
+  std::string checkpoint;
+  unsigned threads = std::max(std::thread::hardware_concurrency(), 1u);
+  std::size_t fast = 0;
 };
 
-error_t init_parsers(int key, char*, argp_state* state) {
-  if (key == ARGP_KEY_INIT) {
-    state->child_inputs[0] = &reinterpret_cast<State*>(state->input)->params;
-    state->child_inputs[1] = &reinterpret_cast<State*>(state->input)->device;
+error_t init_parsers(int key, char* arg, argp_state* state) {
+  State& args = *reinterpret_cast<State*>(state->input);
+  switch (key) {
+    case 'f':
+      args.fill = true;
+      break;
+    case 'p':
+      args.checkpoint = arg;
+      break;
+    case 'j':
+      args.threads = std::max<std::int64_t>(from_string<std::int64_t>(arg), 0);
+      if (args.threads == 0)
+        argp_failure(state, 1, 0, "Number of threads must be positive");
+      break;
+    case 'F':
+      args.fast = std::max<std::int64_t>(from_string<std::int64_t>(arg), 0);
+      if (args.fast == 0)
+        argp_failure(state, 1, 0, "Number of fast devices must be positive");
+      break;
+    case ARGP_KEY_INIT:
+      state->child_inputs[0] = &args.params;
+      state->child_inputs[1] = &args.devices;
+      break;
+    default:
+      return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
+
+// A checkpoint holds the device size and the offset filled up to
+std::uint64_t read_checkpoint(const std::string& file, std::uint64_t size) {
+  std::ifstream in(file);
+  if (!in)
     return 0;
+  std::uint64_t checkpoint_size, offset;
+  if (!(in >> checkpoint_size >> offset) || checkpoint_size != size ||
+      offset > size)
+    throw std::runtime_error("checkpoint " + file + " doesn't match device");
+  return offset;
+}
+
+void write_checkpoint(const std::string& file, std::uint64_t size,
+    std::uint64_t offset) {
+  {
+    std::ofstream out(file + ".tmp");
+    out << size << " " << offset << std::endl;
+    if (!out)
+      throw std::runtime_error("can't write checkpoint " + file);
   }
-  return ARGP_ERR_UNKNOWN;
+  if (std::rename((file + ".tmp").c_str(), file.c_str()) != 0)
+    throw std::runtime_error("can't write checkpoint " + file);
+}
+
+void fill(State& state, BlockDevice& device) {
+  std::uint64_t size = device.size();
+  std::uint64_t begin = 0;
+  if (!state.checkpoint.empty()) {
+    begin = read_checkpoint(state.checkpoint, size);
+    if (begin != 0)
+      std::cout << "Resuming fill at " << (begin >> 20) << " MiB."
+        << std::endl;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  auto saved = start;
+  RandomFill filler(device, state.threads);
+  filler.fill(begin, size, [&](std::uint64_t offset) {
+    auto now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now-start).count();
+    std::cout << "\r" << (offset >> 20) << "/" << (size >> 20) << " MiB ("
+      << (size ? 100*offset/size : 100) << "%), "
+      << static_cast<std::uint64_t>((offset-begin)/(seconds+1e-9)) / (1 << 20)
+      << " MiB/s   " << std::flush;
+    // Only record what is known to be on the device
+    if (!state.checkpoint.empty() && offset < size &&
+        now-saved >= std::chrono::seconds(10)) {
+      device.sync();
+      write_checkpoint(state.checkpoint, size, offset);
+      saved = now;
+    }
+  });
+  std::cout << std::endl;
+  if (!state.checkpoint.empty())
+    std::remove(state.checkpoint.c_str());
 }
 
 int main(int argc, char *argv[])
   try {
     State state;
     state.params.block_size = 4 << 20;
+    state.params.chunk_size = 64 << 10;
     state.params.iters = 1000;
     state.params.key_size = 256/8;
     state.params.hash = "SHA256";
     state.params.device_cipher = "aes-cbc-essiv:sha256";
     state.params.superblock_cipher = "AES256";
+    state.params.superblock_mode = "GCM";
     state.params.salt = nonce(16);
 
     std::string doc = static_doc;
@@ -50,19 +155,57 @@ int main(int argc, char *argv[])
     for (auto algo : block_ciphers())
       doc += ' ' + algo;
     doc += "\nSome ciphers might not be secure.";
+    doc += "\n\nAvaliable cipher modes for encrypting partition headers:";
+    for (auto mode : cipher_modes())
+      doc += ' ' + mode;
+    doc += "\nGCM and OCB require a cipher with a 128-bit block size.";
 
-    auto parsers = new_subparser({"params", "device"});
+    auto parsers = new_subparser({"params", "devices", "stats"});
 
-    argp argp = {nullptr, init_parsers, nullptr, doc.c_str(), parsers.get(),
+    argp argp = {options, init_parsers, nullptr, doc.c_str(), parsers.get(),
       nullptr, nullptr};
     argp_parse(&argp, argc, argv, 0, nullptr, &state);
 
+    state.params.chunk_size = std::min(state.params.chunk_size,
+        state.params.block_size);
+    if (state.params.block_size % state.params.chunk_size != 0) {
+      std::cerr << "Error: Chunk size must divide the block size." << std::endl;
+      return 1;
+    }
+
     Hash hash(state.params.hash);
+    // Reject cipher and mode combinations libgcrypt doesn't support
+    Symmetric cipher(state.params.superblock_cipher,
+        cipher_mode(state.params.superblock_mode));
+
+    if (!state.checkpoint.empty() && state.devices.size() > 1) {
+      std::cerr << "Error: --checkpoint takes a single device." << std::endl;
+      return 1;
+    }
+    if (state.fast >= state.devices.size()) {
+      std::cerr << "Error: --fast needs slower devices after the fast ones."
+        << std::endl;
+      return 1;
+    }
+
+    // The header goes on last, as filling overwrites it
+    if (state.fill)
+      for (auto& device : state.devices)
+        fill(state, device);
 
     state.params.iters = PBKDF2::benchmark(hash, state.params.iters);
     state.params.iters /= (state.params.key_size + hash.size()-1)/hash.size();
 
-    state.params.store(state.device);
+    if (state.devices.size() > 1) {
+      state.params.volume_id = nonce(16);
+      state.params.fast_devices = state.fast;
+      for (const auto& device : state.devices)
+        state.params.devices.push_back(device.size()/state.params.block_size);
+    }
+    for (std::size_t i = 0; i < state.devices.size(); i++) {
+      state.params.device_index = i;
+      state.params.store(state.devices[i]);
+    }
 
     return 0;
   } catch(const std::exception& e) {
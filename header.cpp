@@ -1,91 +1,267 @@
 #include "header.h"
 #include "crypto.h"
 #include "PBKDF2.h"
+#include "buffer.h"
+#include "stats.h"
 #include <algorithm>
+#include <limits>
+
+// Headers are read and written in one piece. Since version 1, fields sit at
+// fixed offsets after the magic number and a version number, with strings
+// padded with zeroes; the rest of the first HEADER_SIZE bytes is reserved for
+// fields of later versions and kept zero. Legacy headers have the block size
+// where the version is now, and length-prefixed fields one after another.
+// Version 2 adds the devices of volumes that span several, and which of them
+// are fast, and is only written for those.
+static const std::size_t HEADER_SIZE = 512;
+static const std::uint32_t HEADER_VERSION = 1;
+static const std::uint32_t HEADER_VERSION_DEVICES = 2;
+static const std::size_t MAX_DEVICES = 16;
+static const std::uint32_t LEGACY_MIN_BLOCK_SIZE = 512;
+
+struct HeaderField {
+  std::size_t offset, size;
+};
+
+static const HeaderField FIELD_VERSION = {4, 4};
+static const HeaderField FIELD_BLOCK_SIZE = {8, 4};
+static const HeaderField FIELD_KEY_SIZE = {12, 4};
+static const HeaderField FIELD_ITERS = {16, 4};
+static const HeaderField FIELD_CHUNK_SIZE = {20, 4};
+static const HeaderField FIELD_SALT_SIZE = {24, 4};
+static const HeaderField FIELD_DEVICE_CIPHER = {32, 64};
+static const HeaderField FIELD_SUPERBLOCK_CIPHER = {96, 32};
+static const HeaderField FIELD_HASH = {128, 32};
+static const HeaderField FIELD_SUPERBLOCK_MODE = {160, 16};
+static const HeaderField FIELD_SALT = {176, 64};
+static const HeaderField FIELD_VOLUME_ID = {240, 16};
+static const HeaderField FIELD_DEVICE_INDEX = {256, 4};
+static const HeaderField FIELD_DEVICE_COUNT = {260, 4};
+static const HeaderField FIELD_DEVICE_BLOCKS = {264, 8*MAX_DEVICES};
+static const HeaderField FIELD_FAST_DEVICES = {392, 4};
+
+static void put_uint(std::string& header, HeaderField field,
+    std::uint32_t value) {
+  BufferWriter(&header[field.offset], field.size).le(value);
+}
+
+static void put_string(std::string& header, HeaderField field,
+    const std::string& value, const std::string& name) {
+  if (value.size() > field.size)
+    throw std::out_of_range(name + " too long for the header");
+  BufferWriter(&header[field.offset], field.size).bytes(value);
+}
+
+static std::uint32_t get_uint(const std::string& header, HeaderField field) {
+  return BufferReader(&header[field.offset], field.size).le<std::uint32_t>();
+}
+
+static std::string get_string(const std::string& header, HeaderField field) {
+  const char* data = &header[field.offset];
+  return std::string(data, std::find(data, data+field.size, '\0'));
+}
 
 void Params::store(BlockDevice& device) {
-  device.seek(0);
-  
-  // Wipe header block
-  device.write(std::string(block_size, '\0'));
-  device.seek(0);
-
-  device.write(std::string(HEADER_MAGIC_STR, sizeof(HEADER_MAGIC_STR)-1));
-  device.write(htole32_str(block_size));
-  device.write(htole32_str(key_size));
-  device.write(htole32_str(device_cipher.size()));
-  device.write(device_cipher);
-  device.write(htole32_str(superblock_cipher.size()));
-  device.write(superblock_cipher);
-  device.write(htole32_str(hash.size()));
-  device.write(hash.data());
-  device.write(htole32_str(salt.size()));
-  device.write(salt.data());
-  device.write(htole32_str(iters));
-}
-
-static std::string read_bytes(BlockDevice& device, std::size_t n,
-    std::int64_t& bytes, const std::string& message) {
-  if (bytes < n)
-    throw std::out_of_range(message);
-  bytes -= n;
-  return device.read(n);
-}
-
-static inline std::uint32_t read_uint_le32(BlockDevice& device,
-    std::int64_t& bytes, const std::string& message) {
-  return le32toh_str(read_bytes(device, 4, bytes, message));
+  // The rest of the header block is wiped in the same write
+  std::string header(std::max(block_size, HEADER_SIZE), '\0');
+  header.replace(0, sizeof(HEADER_MAGIC_STR)-1, HEADER_MAGIC_STR);
+  put_uint(header, FIELD_VERSION,
+      devices.empty() ? HEADER_VERSION : HEADER_VERSION_DEVICES);
+  put_uint(header, FIELD_BLOCK_SIZE, block_size);
+  put_uint(header, FIELD_KEY_SIZE, key_size);
+  put_uint(header, FIELD_ITERS, iters);
+  put_uint(header, FIELD_CHUNK_SIZE, chunk_size);
+  put_uint(header, FIELD_SALT_SIZE, salt.size());
+  put_string(header, FIELD_DEVICE_CIPHER, device_cipher, "device cipher");
+  put_string(header, FIELD_SUPERBLOCK_CIPHER, superblock_cipher,
+      "superblock cipher");
+  put_string(header, FIELD_HASH, hash, "hash function");
+  put_string(header, FIELD_SUPERBLOCK_MODE, superblock_mode,
+      "superblock cipher mode");
+  put_string(header, FIELD_SALT, salt, "salt");
+  if (!devices.empty()) {
+    if (devices.size() > MAX_DEVICES)
+      throw std::out_of_range("too many devices");
+    if (device_index >= devices.size())
+      throw std::out_of_range("device index");
+    if (fast_devices >= devices.size())
+      throw std::out_of_range("every device is fast");
+    put_string(header, FIELD_VOLUME_ID, volume_id, "volume ID");
+    put_uint(header, FIELD_DEVICE_INDEX, device_index);
+    put_uint(header, FIELD_DEVICE_COUNT, devices.size());
+    BufferWriter writer(&header[FIELD_DEVICE_BLOCKS.offset],
+        FIELD_DEVICE_BLOCKS.size);
+    for (auto blocks : devices)
+      writer.le<std::uint64_t>(blocks);
+    put_uint(header, FIELD_FAST_DEVICES, fast_devices);
+  } else if (fast_devices != 0) {
+    throw std::out_of_range("fast devices on a single device");
+  }
+  device.pwrite(header.data(), header.size(), 0);
+}
+
+// Reads fields of a legacy header one after another
+class LegacyHeader {
+ public:
+  LegacyHeader(const std::string& header, std::size_t block_size)
+    : _reader(header.data(), std::min(header.size(), block_size)) {
+    _reader.skip(sizeof(HEADER_MAGIC_STR)-1+4);
+  }
+
+  std::uint32_t uint(const char* message) {
+    if (_reader.remaining() < 4)
+      throw std::out_of_range(message);
+    return _reader.le<std::uint32_t>();
+  }
+
+  std::string string(const char* message) {
+    std::size_t size = uint(message);
+    if (_reader.remaining() < size)
+      throw std::out_of_range(message);
+    return _reader.string(size);
+  }
+
+ private:
+  BufferReader _reader;
+};
+
+static void load_legacy(Params& params, const std::string& header) {
+  LegacyHeader legacy(header, params.block_size);
+  params.key_size = legacy.uint("key size");
+  params.device_cipher = legacy.string("device cipher");
+  params.superblock_cipher = legacy.string("superblock cipher");
+  params.hash = legacy.string("hash function");
+  params.salt = legacy.string("salt");
+  params.iters = legacy.uint("PBKDF2 iterations");
+  // Absent in the oldest headers, which are followed by zeroes
+  params.superblock_mode = legacy.string("superblock cipher mode");
+  params.chunk_size = legacy.uint("superblock chunk size");
 }
 
 void Params::load(BlockDevice& device) {
-  device.seek(0);
-  std::int64_t bytes = 0;
-  
-  // magic number
-  if (device.read(sizeof(HEADER_MAGIC_STR)-1) != HEADER_MAGIC_STR)
+  stats::Timer timer("params_load");
+  std::string header(HEADER_SIZE, '\0');
+  device.pread(&header[0], header.size(), 0);
+
+  if (header.compare(0, sizeof(HEADER_MAGIC_STR)-1, HEADER_MAGIC_STR) != 0)
     throw std::runtime_error("Wrong magic number");
-  bytes -= sizeof(HEADER_MAGIC_STR)-1;
-  
-  // block size
-  block_size = le32toh_str(device.read(4));
-  bytes += block_size - 4;
-  if (bytes < 0)
-    throw std::out_of_range("block size");
 
-  // key size
-  key_size = read_uint_le32(device, bytes, "key size");
+  std::uint32_t version = get_uint(header, FIELD_VERSION);
+  if (version >= LEGACY_MIN_BLOCK_SIZE) {
+    block_size = version;
+    try {
+      load_legacy(*this, header);
+    } catch(const std::out_of_range&) {
+      // Only legacy headers with unusually long fields take more
+      if (block_size <= header.size())
+        throw;
+      header.resize(block_size);
+      device.pread(&header[0], header.size(), 0);
+      load_legacy(*this, header);
+    }
+  } else if (version == HEADER_VERSION || version == HEADER_VERSION_DEVICES) {
+    block_size = get_uint(header, FIELD_BLOCK_SIZE);
+    key_size = get_uint(header, FIELD_KEY_SIZE);
+    iters = get_uint(header, FIELD_ITERS);
+    chunk_size = get_uint(header, FIELD_CHUNK_SIZE);
+    device_cipher = get_string(header, FIELD_DEVICE_CIPHER);
+    superblock_cipher = get_string(header, FIELD_SUPERBLOCK_CIPHER);
+    hash = get_string(header, FIELD_HASH);
+    superblock_mode = get_string(header, FIELD_SUPERBLOCK_MODE);
+    std::size_t salt_size = get_uint(header, FIELD_SALT_SIZE);
+    if (salt_size > FIELD_SALT.size)
+      throw std::out_of_range("salt");
+    salt = header.substr(FIELD_SALT.offset, salt_size);
+  } else {
+    throw std::runtime_error("unsupported header version");
+  }
 
-  {  // dm-crypt cipher    
-    std::size_t cipher_size = read_uint_le32(device, bytes,
-        "device cipher size");
-    device_cipher = read_bytes(device, cipher_size, bytes, "device cipher");
+  devices.clear();
+  volume_id.clear();
+  device_index = 0;
+  fast_devices = 0;
+  if (version == HEADER_VERSION_DEVICES) {
+    volume_id = header.substr(FIELD_VOLUME_ID.offset, FIELD_VOLUME_ID.size);
+    device_index = get_uint(header, FIELD_DEVICE_INDEX);
+    std::size_t count = get_uint(header, FIELD_DEVICE_COUNT);
+    if (count == 0 || count > MAX_DEVICES || device_index >= count)
+      throw std::out_of_range("devices");
+    BufferReader reader(&header[FIELD_DEVICE_BLOCKS.offset],
+        FIELD_DEVICE_BLOCKS.size);
+    for (std::size_t i = 0; i < count; i++)
+      devices.push_back(reader.le<std::uint64_t>());
+    fast_devices = get_uint(header, FIELD_FAST_DEVICES);
+    if (fast_devices >= count)
+      throw std::out_of_range("fast devices");
   }
 
-  {  // libgcrypt cipher
-    std::size_t cipher_size = read_uint_le32(device, bytes,
-        "superblock cipher size");
-    superblock_cipher = read_bytes(device, cipher_size, bytes,
-        "superblock cipher");
+  if (block_size < LEGACY_MIN_BLOCK_SIZE)
+    throw std::out_of_range("block size");
+  if (chunk_size == 0)
+    chunk_size = block_size;
+  if (block_size % chunk_size != 0)
+    throw std::out_of_range("superblock chunk size");
+}
+
+void Params::load(std::vector<BlockDevice>& devs) {
+  if (devs.empty())
+    throw std::invalid_argument("no devices");
+  load(devs.front());
+  if (devices.empty()) {
+    if (devs.size() > 1)
+      throw std::runtime_error("the volume is on a single device");
+    return;
   }
-  
-  {  // hash function
-    std::size_t hash_size = read_uint_le32(device, bytes,
-        "hash function size");
-    hash = read_bytes(device, hash_size, bytes, "hash function");
+  if (devs.size() != devices.size())
+    throw std::runtime_error("the volume spans " +
+        std::to_string(devices.size()) + " devices");
+
+  std::vector<BlockDevice> sorted(devs.size());
+  for (auto& dev : devs) {
+    Params other;
+    other.load(dev);
+    if (other.volume_id != volume_id || other.devices != devices ||
+        other.fast_devices != fast_devices)
+      throw std::runtime_error("devices of different volumes");
+    if (sorted[other.device_index].open())
+      throw std::runtime_error("the same device given twice");
+    if (dev.size()/block_size < devices[other.device_index])
+      throw std::runtime_error("a device is smaller than the volume needs");
+    sorted[other.device_index] = std::move(dev);
   }
+  devs = std::move(sorted);
+  device_index = 0;
+}
 
-  {  // salt
-    std::size_t salt_size = read_uint_le32(device, bytes, "salt size");
-    salt = read_bytes(device, salt_size, bytes, "salt");
+std::vector<std::uint64_t> Params::bounds(std::uint64_t device_blocks) const {
+  std::vector<std::uint64_t> ret(1, 0);
+  if (devices.empty()) {
+    ret.push_back(device_blocks);
+    return ret;
   }
+  for (auto blocks : devices)
+    ret.push_back(ret.back()+blocks);
+  return ret;
+}
 
-  // PBKDF2 iterations
-  iters = read_uint_le32(device, bytes, "PBKDF2 iterations");
+std::vector<std::uint64_t> Params::tier_bounds(std::uint64_t device_blocks,
+    bool fast) const {
+  auto all = bounds(device_blocks);
+  if (fast)
+    return std::vector<std::uint64_t>(all.begin(),
+        all.begin()+fast_devices+1);
+  return std::vector<std::uint64_t>(all.begin()+fast_devices, all.end());
 }
 
-std::uint64_t Params::locate_superblock(const std::string& passphrase,
-    std::uint64_t blocks) const {
-  Hash _hash(hash);
+// Candidate locations of a superblock
+static const std::size_t SUPERBLOCK_CANDIDATES = 4;
+
+std::vector<std::uint64_t> Params::locate_superblock(
+    const SecureString& passphrase, std::uint64_t blocks) const {
+  stats::Timer timer("superblock_locate");
+  if (blocks < 2)
+    throw std::out_of_range("no room for a superblock");
+  Hash _hash(hash, true);
   gpg_error_t error;
   gcry_mpi_t x = nullptr, divisor, L;
   {
@@ -93,17 +269,19 @@ std::uint64_t Params::locate_superblock(const std::string& passphrase,
     if ((error = gcry_mpi_scan(&divisor, GCRYMPI_FMT_USG,
             hash_max.data(), hash_max.size(), nullptr)) != GPG_ERR_NO_ERROR)
       throw std::system_error(gcrypt_error_code(error), gpg_category());
-    blocks = htobe64(blocks-1);
+    unsigned char last[8];
+    BufferWriter(last, sizeof(last)).be(blocks-1);
     if ((error = gcry_mpi_scan(&L, GCRYMPI_FMT_USG,
-            &blocks, 8, nullptr)) != GPG_ERR_NO_ERROR)
+            last, sizeof(last), nullptr)) != GPG_ERR_NO_ERROR)
       throw std::system_error(gcrypt_error_code(error), gpg_category());
     gcry_mpi_div(divisor, nullptr, divisor, L, 0);
   }
 
   std::size_t i = 1;
+  SecureString key;
   do {
     gcry_mpi_release(x);
-    std::string key = PBKDF2::F(_hash, passphrase, salt, iters, i);
+    key = PBKDF2::F(_hash, passphrase, salt, iters, i++);
     if ((error = gcry_mpi_scan(&x, GCRYMPI_FMT_USG,
             key.data(), key.size(), nullptr)) != GPG_ERR_NO_ERROR)
       throw std::system_error(gcrypt_error_code(error), gpg_category());
@@ -116,109 +294,810 @@ std::uint64_t Params::locate_superblock(const std::string& passphrase,
         != GPG_ERR_NO_ERROR)
     throw std::system_error(gcrypt_error_code(error), gpg_category());
 
-  std::uint64_t ret = 0;
-  std::size_t offset = 0;
-  for (i = 0; i < written; i++) {
-    ret = buf[i] << offset;
-    offset += 8;
+  gcry_mpi_release(x);
+  gcry_mpi_release(divisor);
+  gcry_mpi_release(L);
+
+  // Decoded as it always has been: only the last byte counts, shifted as a
+  // signed int. That is the intended block on volumes of up to 257 blocks,
+  // and often past the end of larger ones.
+  std::uint64_t legacy = 0;
+  if (written > 4)
+    legacy = std::numeric_limits<std::uint64_t>::max()-1;
+  else if (written > 0)
+    legacy = std::int64_t(std::int32_t(std::uint32_t(buf[written-1]) <<
+          8*(written-1)));
+
+  std::vector<std::uint64_t> ret;
+  if (legacy+1 < blocks)
+    ret.push_back(legacy+1);
+  // The others hash the derived key with their number, which costs nothing
+  // next to the key derivation
+  for (unsigned char n = 1; ret.size() < SUPERBLOCK_CANDIDATES; n++) {
+    Hash candidate(hash, true);
+    candidate.update(key);
+    candidate.update(&n, 1);
+    SecureString digest(candidate.size(), '\0');
+    candidate.digest(&digest[0]);
+    std::uint64_t block = BufferReader(digest.data(), 8).be<std::uint64_t>()%
+      (blocks-1)+1;
+    if (std::find(ret.begin(), ret.end(), block) == ret.end())
+      ret.push_back(block);
+    else if (n == 0xFF)
+      break;
   }
+  return ret;
+}
 
-  return ret+1;
+SecureString Params::disk_key(const SecureString& passphrase) const {
+  Hash _hash(hash, true);
+  return PBKDF2::PBKDF2(_hash, passphrase, salt, iters, key_size);
 }
 
-Superblock::Superblock(const Params& _params, const std::string& passphrase,
+// Chunks in CBC mode start with a checksum of the whole chunk. Chunks in AEAD
+// modes are laid out as nonce, ciphertext and tag, and the tag also covers the
+// chunk's index in the chain so that chunks can't be reordered.
+static const std::size_t AEAD_NONCE_SIZE = 12;
+static const std::size_t AEAD_TAG_SIZE = 16;
+
+// The chunk's index in the chain as associated data
+static void authenticate_index(Symmetric& cipher, std::uint64_t index) {
+  unsigned char data[8];
+  BufferWriter(data, sizeof(data)).le(index);
+  cipher.authenticate(data, sizeof(data));
+}
+
+static std::size_t payload_size(const Params& params) {
+  std::size_t overhead;
+  switch (cipher_mode(params.superblock_mode)) {
+    case GCRY_CIPHER_MODE_GCM:
+    case GCRY_CIPHER_MODE_OCB:
+      overhead = AEAD_NONCE_SIZE+AEAD_TAG_SIZE;
+      break;
+    default:
+      overhead = (hash_size(params.hash)+7)/8*8;
+  }
+  return (params.chunk_size-overhead)/8*8;
+}
+
+Superblock::Superblock(const Params& _params, const SecureString& passphrase,
     std::uint64_t _blocks)
-    : params(_params), cipher(_params.superblock_cipher) {
-  blocks.push_back(params.locate_superblock(passphrase, _blocks));
-  Hash hash(params.hash);
-  std::string key_iv = PBKDF2::PBKDF2(hash, passphrase, params.salt,
+    : params(_params), cipher(_params.superblock_cipher,
+        cipher_mode(_params.superblock_mode), true) {
+  stats::Timer timer("superblock_unlock");
+  candidates = params.locate_superblock(passphrase, _blocks);
+  blocks.push_back(candidates.front());
+  Hash hash(params.hash, true);
+  if (cipher.aead()) {
+    SecureString key = PBKDF2::PBKDF2(hash, passphrase, params.salt,
+        params.iters, cipher.key_size());
+    cipher.set_key(key.data(), key.size());
+    return;
+  }
+  SecureString key_iv = PBKDF2::PBKDF2(hash, passphrase, params.salt,
       params.iters, cipher.key_size()+cipher.block_size());
-  cipher.set_key(key_iv.substr(0, cipher.key_size()));
-  iv = key_iv.substr(cipher.key_size());
-  cipher.set_iv(iv);
+  cipher.set_key(key_iv.data(), cipher.key_size());
+  iv.assign(key_iv, cipher.key_size(), std::string::npos);
+  cipher.set_iv(iv.data(), iv.size());
 }
 
-void Superblock::store(BlockDevice& dev) {
-  std::string superblock;
-  superblock.reserve(blocks.size()*8);
-  superblock += htole64_str(blocks.size()-1);
-  for (auto block = blocks.begin()+1; block != blocks.end(); ++block)
-    superblock += htole64_str(*block);
+std::string Superblock::seal(const std::string& payload,
+    std::uint64_t index) {
+  if (cipher.aead()) {
+    std::string chunk_nonce = nonce(AEAD_NONCE_SIZE);
+    std::string data = payload;
+    data.resize(params.chunk_size-AEAD_NONCE_SIZE-AEAD_TAG_SIZE, '\x00');
+    cipher.reset(chunk_nonce);
+    authenticate_index(cipher, index);
+    cipher.final();
+    data = cipher.encrypt(data);
+    return chunk_nonce + data + cipher.tag();
+  }
 
   Hash hash(params.hash);
   std::size_t checksum_size = (hash.size()+7)/8*8;
-  std::size_t written = 0;
-  offset = 0;
-  for (auto block = blocks.begin();
-      written < superblock.size();
-      written += params.block_size, ++block, ++offset) {
-    if (*block == 0)
-      throw std::out_of_range("unmapped block in superblock storage");
-    std::string chunk = std::string(hash.size(), '\x00') +
-      nonce(params.block_size-hash.size());
-    std::string data = superblock.substr(written,
-        params.block_size-checksum_size);
-    std::copy(data.begin(), data.end(), chunk.begin()+checksum_size);
-    hash.update(chunk);
-    std::copy_n(hash.digest().begin(), hash.size(), chunk.begin());
-    hash.reset();
-    dev.seek((*block)*params.block_size);
-    cipher.reset(iv);
-    dev.write(cipher.encrypt(chunk));
-    written += params.block_size-checksum_size;
-  }
+  std::string chunk(params.chunk_size, '\x00');
+  random.fill(&chunk[hash.size()], chunk.size()-hash.size());
+  std::copy(payload.begin(), payload.end(), chunk.begin()+checksum_size);
+  hash.update(chunk);
+  std::copy_n(hash.digest().begin(), hash.size(), chunk.begin());
+  cipher.reset(iv.data(), iv.size());
+  return cipher.encrypt(chunk);
 }
 
-void Superblock::load(BlockDevice& dev) {
+std::string Superblock::unseal(const std::string& chunk,
+    std::uint64_t index) {
+  if (cipher.aead()) {
+    std::size_t data_size = chunk.size()-AEAD_NONCE_SIZE-AEAD_TAG_SIZE;
+    cipher.reset(chunk.substr(0, AEAD_NONCE_SIZE));
+    authenticate_index(cipher, index);
+    cipher.final();
+    std::string data = cipher.decrypt(chunk.substr(AEAD_NONCE_SIZE,
+          data_size));
+    if (!cipher.check_tag(chunk.substr(AEAD_NONCE_SIZE+data_size)))
+      throw std::runtime_error("checksum mismatch");
+    data.resize(payload_size(params));
+    return data;
+  }
+
   Hash hash(params.hash);
   std::size_t checksum_size = (hash.size()+7)/8*8;
-  // first chunk
-  dev.seek(blocks.front()*params.block_size);
-  cipher.reset(iv);
-  std::string chunk = cipher.decrypt(dev.read(params.block_size));
-  std::string checksum = chunk.substr(0, hash.size());
-  std::copy_n(std::string(hash.size(), '\x00').begin(), hash.size(), 
-      chunk.begin());
-  hash.update(chunk);
+  cipher.reset(iv.data(), iv.size());
+  std::string data = cipher.decrypt(chunk);
+  std::string checksum = data.substr(0, hash.size());
+  std::fill_n(data.begin(), hash.size(), '\x00');
+  hash.update(data);
   if (checksum != hash.digest())
     throw std::runtime_error("checksum mismatch");
-  hash.reset();
-  std::uint64_t block_count = le64toh_str(chunk.substr(checksum_size, 8));
+  return data.substr(checksum_size);
+}
+
+// The block map is stored in one of three layouts. Old superblocks start
+// with the number of entries followed by every entry as a little-endian 64-bit
+// integer. Versioned superblocks start with VERSIONED|version instead, the
+// number of entries, the number of blocks holding the superblock and the
+// number of chunks. Each chunk then lists a run of entries, either raw or as
+// extents, whichever fits more of them.
+//
+// In version 2 every chunk has two copies side by side. A store writes the
+// chunks that changed over their unused copies, and then commits them by
+// writing the root chunk over its own unused copy. The root chunk holds a
+// generation number to tell its copies apart and a bitmap of which copy of
+// every other chunk is current, so a torn store leaves the previous
+// superblock intact. Version 2 needs at least two chunks per block, so that
+// both copies of the root can be found; otherwise version 1 is written, with a
+// single copy of every chunk.
+//
+// Version 3 is version 2 when the chunk size allows it and version 1
+// otherwise, with a list of tagged properties at the end of the root header.
+static const std::uint64_t VERSIONED = std::uint64_t(1) << 63;
+static const std::size_t ROOT_HEADER_MAX = 8+4*10;
+static const std::size_t PROPERTIES_MAX = 256;
+
+enum Property : std::uint64_t {
+  PROPERTY_RUN_LENGTH = 1,
+  PROPERTY_LOGICAL_IV = 2,
+  PROPERTY_DISK_KEY = 3,
+  PROPERTY_DEVICE_CIPHER = 4,
+  PROPERTY_NEXT_KEY = 5,
+  PROPERTY_NEXT_CIPHER = 6,
+  PROPERTY_REENCRYPTED = 7,
+};
+static const std::size_t CHUNK_HEADER_MAX = 1+10;
+
+enum ChunkEncoding : char {
+  CHUNK_RAW = 0,
+  CHUNK_EXTENTS = 1,
+};
+
+static void put_varint(std::string& out, std::uint64_t i) {
+  char data[10];
+  BufferWriter writer(data, sizeof(data));
+  writer.varint(i);
+  out.append(data, writer.pos());
+}
+
+static void put_uint64(std::string& out, std::uint64_t i) {
+  char data[8];
+  BufferWriter(data, sizeof(data)).le(i);
+  out.append(data, sizeof(data));
+}
+
+// Encodes as many entries from blocks[first] onwards as fit in room bytes.
+// Extents are either holes, or runs of consecutive blocks whose start is
+// stored relative to the end of the previous run.
+static std::size_t encode_extents(const std::vector<std::uint64_t>& blocks,
+    std::size_t first, std::size_t room, std::string& out) {
+  std::uint64_t end = 0;
+  std::size_t i = first;
+  while (i < blocks.size()) {
+    std::size_t length = 1;
+    std::string record;
+    if (blocks[i] == 0) {
+      while (i+length < blocks.size() && blocks[i+length] == 0)
+        length++;
+      put_varint(record, length << 1 | 1);
+    } else {
+      while (i+length < blocks.size() && blocks[i+length] == blocks[i]+length)
+        length++;
+      std::int64_t delta = blocks[i]-end;
+      put_varint(record, length << 1);
+      put_varint(record, (std::uint64_t(delta) << 1) ^
+          std::uint64_t(delta >> 63));
+      end = blocks[i]+length;
+    }
+    if (out.size()+record.size() > room)
+      break;
+    out += record;
+    i += length;
+  }
+  return i-first;
+}
+
+// Encodes one chunk's worth of entries from blocks[first] onwards
+static std::size_t encode_chunk(const std::vector<std::uint64_t>& blocks,
+    std::size_t first, std::size_t room, std::string& out) {
+  room -= CHUNK_HEADER_MAX;
+  std::string data;
+  std::size_t n = encode_extents(blocks, first, room, data);
+  std::size_t raw = std::min<std::size_t>(room/8, blocks.size()-first);
+  char encoding = CHUNK_EXTENTS;
+  if (n < raw) {
+    encoding = CHUNK_RAW;
+    n = raw;
+    data.resize(n*8);
+    BufferWriter writer(&data[0], data.size());
+    for (std::size_t i = first; i < first+n; i++)
+      writer.le(blocks[i]);
+  }
+  out += encoding;
+  put_varint(out, n);
+  out += data;
+  return n;
+}
+
+static void decode_chunk(BufferReader& chunk,
+    std::vector<std::uint64_t>& blocks, std::uint64_t block_count) {
+  char encoding = chunk.byte();
+  std::uint64_t n = chunk.varint();
+  if (n > block_count-(blocks.size()-1))
+    throw std::out_of_range("malformed superblock");
+  switch (encoding) {
+    case CHUNK_RAW:
+      if (n > chunk.remaining()/8)
+        throw std::out_of_range("truncated superblock");
+      for (; n > 0; n--)
+        blocks.push_back(chunk.le<std::uint64_t>());
+      break;
+    case CHUNK_EXTENTS: {
+        std::uint64_t end = 0;
+        while (n > 0) {
+          std::uint64_t length = chunk.varint();
+          bool hole = length & 1;
+          length >>= 1;
+          if (length == 0 || length > n)
+            throw std::out_of_range("malformed superblock");
+          n -= length;
+          if (hole) {
+            blocks.resize(blocks.size()+length, 0);
+            continue;
+          }
+          std::uint64_t delta = chunk.varint();
+          std::uint64_t start = end+((delta >> 1) ^ (~(delta & 1)+1));
+          for (std::uint64_t i = 0; i < length; i++)
+            blocks.push_back(start+i);
+          end = start+length;
+        }
+        break;
+      }
+    default:
+      throw std::runtime_error("unknown superblock chunk encoding");
+  }
+}
+
+// Splits the entries from blocks[1] on into chunks, the root one with
+// root_room bytes and the others with room bytes. Chunks after the root
+// start with the index of their first entry if indexed.
+static std::vector<std::string> encode_chunks(
+    const std::vector<std::uint64_t>& blocks, std::size_t root_room,
+    std::size_t room, bool indexed) {
+  std::vector<std::string> chunks(1);
+  std::size_t next = 1+encode_chunk(blocks, 1, root_room, chunks.front());
+  while (next < blocks.size()) {
+    chunks.emplace_back();
+    if (indexed)
+      put_varint(chunks.back(), next);
+    next += encode_chunk(blocks, next, room, chunks.back());
+  }
+  return chunks;
+}
+
+static std::size_t bitmap_size(const Params& params, std::uint64_t offset) {
+  return (offset*(params.block_size/params.chunk_size)/2+7)/8;
+}
+
+std::string Superblock::properties() const {
+  auto properties = _properties;
+  if (run_length != 1) {
+    std::string value;
+    put_varint(value, run_length);
+    properties[PROPERTY_RUN_LENGTH] = value;
+  }
+  if (logical_iv)
+    properties[PROPERTY_LOGICAL_IV] = "";
+  if (!disk_key.empty())
+    properties[PROPERTY_DISK_KEY].assign(disk_key.data(), disk_key.size());
+  if (!device_cipher.empty())
+    properties[PROPERTY_DEVICE_CIPHER] = device_cipher;
+  if (!next_key.empty()) {
+    std::string value;
+    put_varint(value, reencrypted);
+    properties[PROPERTY_NEXT_KEY].assign(next_key.data(), next_key.size());
+    properties[PROPERTY_NEXT_CIPHER] = next_cipher;
+    properties[PROPERTY_REENCRYPTED] = value;
+  }
+
+  std::string ret;
+  put_varint(ret, properties.size());
+  for (const auto& property : properties) {
+    put_varint(ret, property.first);
+    put_varint(ret, property.second.size());
+    ret += property.second;
+  }
+  if (ret.size() > PROPERTIES_MAX)
+    throw std::out_of_range("superblock properties too large");
+  return ret;
+}
+
+void Superblock::parse_properties(BufferReader& root) {
+  _properties.clear();
+  run_length = 1;
+  logical_iv = false;
+  disk_key.clear();
+  device_cipher.clear();
+  next_key.clear();
+  next_cipher.clear();
+  reencrypted = 0;
+  for (std::uint64_t n = root.varint(); n > 0; n--) {
+    std::uint64_t tag = root.varint();
+    std::uint64_t size = root.varint();
+    if (size > root.remaining())
+      throw std::out_of_range("truncated superblock");
+    BufferReader value(root.data(), size);
+    root.skip(size);
+    switch (tag) {
+      case PROPERTY_RUN_LENGTH:
+        run_length = value.varint();
+        if (run_length == 0)
+          throw std::out_of_range("malformed superblock");
+        break;
+      case PROPERTY_LOGICAL_IV:
+        logical_iv = true;
+        break;
+      case PROPERTY_DISK_KEY:
+        disk_key.assign(value.data(), size);
+        break;
+      case PROPERTY_DEVICE_CIPHER:
+        device_cipher = value.string(size);
+        break;
+      case PROPERTY_NEXT_KEY:
+        next_key.assign(value.data(), size);
+        break;
+      case PROPERTY_NEXT_CIPHER:
+        next_cipher = value.string(size);
+        break;
+      case PROPERTY_REENCRYPTED:
+        reencrypted = value.varint();
+        break;
+      default:
+        // from a newer version, kept as is
+        _properties[tag] = value.string(size);
+    }
+  }
+}
+
+std::string Superblock::read_slots(BlockDevice& dev, std::uint64_t slot,
+    std::size_t n) {
+  std::size_t chunks_per_block = params.block_size/params.chunk_size;
+  std::uint64_t block = slot/chunks_per_block;
+  if (block >= blocks.size() || blocks[block] == 0)
+    throw std::out_of_range("unmapped block in superblock storage");
+  // A positioned read, so that several superblocks can be loaded at once
+  std::string ret(n*params.chunk_size, '\0');
+  dev.pread(&ret[0], ret.size(), blocks[block]*params.block_size +
+      slot%chunks_per_block*params.chunk_size);
+  return ret;
+}
+
+void Superblock::write_slot(BlockDevice& dev, std::uint64_t slot,
+    const std::string& chunk) {
+  std::size_t chunks_per_block = params.block_size/params.chunk_size;
+  std::uint64_t block = slot/chunks_per_block;
+  if (block >= offset || blocks[block] == 0)
+    throw std::out_of_range("unmapped block in superblock storage");
+  dev.seek(blocks[block]*params.block_size +
+      slot%chunks_per_block*params.chunk_size);
+  dev.write(chunk);
+}
+
+void Superblock::copy_properties(const Superblock& other) {
+  run_length = other.run_length;
+  logical_iv = other.logical_iv;
+  disk_key = other.disk_key;
+  device_cipher = other.device_cipher;
+  next_key = other.next_key;
+  next_cipher = other.next_cipher;
+  reencrypted = other.reencrypted;
+  _properties = other._properties;
+}
+
+void Superblock::set(std::size_t entry, std::uint64_t block) {
+  blocks.at(entry) = block;
+  if (entry < offset) {
+    // The superblock itself moved
+    _moved = true;
+    return;
+  }
+  auto chunk = std::upper_bound(_first.begin(), _first.end(), entry);
+  if (chunk != _first.begin())
+    _dirty[chunk-_first.begin()-1] = true;
+}
+
+bool Superblock::crash_safe() const {
+  return params.block_size/params.chunk_size >= 2 && !_first.empty();
+}
+
+void Superblock::resize(std::size_t size, std::uint64_t block) {
+  _shortest = std::min<std::uint64_t>(_shortest, size);
+  blocks.resize(size, block);
+}
+
+void Superblock::store(BlockDevice& dev) {
+  stats::Timer timer("superblock_store");
+  std::size_t payload = payload_size(params);
+  std::size_t chunks_per_block = params.block_size/params.chunk_size;
+  if (offset == 0 || offset > blocks.size())
+    throw std::out_of_range("superblock size");
+  if (chunks_per_block < 2) {
+    store_unshadowed(dev);
+    return;
+  }
+  std::string root_properties = properties();
+  std::size_t root_room = payload-std::min(payload,
+      ROOT_HEADER_MAX+bitmap_size(params, offset)+root_properties.size());
+  if (root_room <= CHUNK_HEADER_MAX)
+    throw std::out_of_range("superblock too large");
+
+  // Re-encode from each changed chunk until the chunk boundaries line up
+  // with what is on disk again. Chunks go next to their current copies if
+  // those are known, even when all of them are re-encoded.
+  bool known = !_first.empty();
+  bool full = !known || _moved || _offset != offset;
+  std::vector<std::uint64_t> first;
+  std::vector<std::string> chunks;
+  std::vector<bool> slots;
+  std::uint64_t next = 1;
+  for (std::size_t i = 0; i == 0 || next < blocks.size(); i++) {
+    if (!full && i != 0 && i < _first.size() && !_dirty[i] &&
+        _first[i] == next) {
+      std::uint64_t end = i+1 < _first.size() ? _first[i+1] : _stored;
+      if (end <= std::min<std::uint64_t>(_shortest, blocks.size())) {
+        first.push_back(next);
+        chunks.emplace_back();
+        slots.push_back(_slot[i]);
+        next = end;
+        continue;
+      }
+    }
+    std::string chunk;
+    if (i == 0) {
+      next += encode_chunk(blocks, next, root_room, chunk);
+      first.push_back(1);
+    } else {
+      first.push_back(next);
+      put_varint(chunk, next);
+      next += encode_chunk(blocks, next, payload-10, chunk);
+    }
+    chunks.push_back(chunk);
+    slots.push_back(known && i < _slot.size() && !_slot[i]);
+  }
+  if (chunks.size() > offset*chunks_per_block/2)
+    throw std::out_of_range("superblock too large");
+
+  std::uint64_t generation = known ? _generation+1 : 1;
+  bool root_slot = known && !_root_slot;
+  {
+    std::string root;
+    put_uint64(root, VERSIONED | 3);
+    put_varint(root, blocks.size()-1);
+    put_varint(root, offset);
+    put_varint(root, chunks.size());
+    put_varint(root, generation);
+    std::string bitmap(bitmap_size(params, offset), '\x00');
+    for (std::size_t i = 0; i < slots.size(); i++)
+      if (slots[i])
+        bitmap[i/8] |= 1 << i%8;
+    chunks.front() = root + bitmap + root_properties + chunks.front();
+  }
+
+  if (!known) {
+    // Nothing on disk is known to be current, so write whole blocks with the
+    // first copy of every chunk and fill the rest. After loading a layout
+    // without copies, this overwrites it in place.
+    for (std::size_t i = 0; i < offset; i++) {
+      if (blocks[i] == 0)
+        throw std::out_of_range("unmapped block in superblock storage");
+      std::string data(params.block_size, '\x00');
+      random.fill(&data[0], data.size());
+      for (std::size_t slot = i*chunks_per_block;
+          slot < (i+1)*chunks_per_block; slot++)
+        if (slot%2 == 0 && slot/2 < chunks.size()) {
+          std::string chunk = seal(chunks[slot/2], slot/2);
+          std::copy(chunk.begin(), chunk.end(), data.begin() +
+              slot%chunks_per_block*params.chunk_size);
+        }
+      dev.seek(blocks[i]*params.block_size);
+      dev.write(data);
+    }
+    dev.sync();
+  } else {
+    for (std::size_t i = 1; i < chunks.size(); i++)
+      if (!chunks[i].empty())
+        write_slot(dev, 2*i+slots[i], seal(chunks[i], i));
+    dev.sync();
+    write_slot(dev, root_slot, seal(chunks.front(), 0));
+    dev.sync();
+  }
+
+  _first = first;
+  _slot = slots;
+  _dirty.assign(first.size(), false);
+  _generation = generation;
+  _root_slot = root_slot;
+  _stored = blocks.size();
+  _shortest = blocks.size();
+  _offset = offset;
+  _moved = false;
+}
+
+void Superblock::store_unshadowed(BlockDevice& dev) {
+  std::size_t payload = payload_size(params);
+  std::size_t chunks_per_block = params.block_size/params.chunk_size;
+
+  std::string root_properties = properties();
+  if (payload <= ROOT_HEADER_MAX+root_properties.size()+CHUNK_HEADER_MAX)
+    throw std::out_of_range("superblock too large");
+  auto chunks = encode_chunks(blocks,
+      payload-ROOT_HEADER_MAX-root_properties.size(), payload, false);
+  {
+    std::string root;
+    put_uint64(root, VERSIONED | 3);
+    put_varint(root, blocks.size()-1);
+    put_varint(root, offset);
+    put_varint(root, chunks.size());
+    chunks.front() = root + root_properties + chunks.front();
+  }
+
+  if (chunks.size() > offset*chunks_per_block) {
+    // Superblocks written before the versioned format are sized for raw
+    // entries only, and might not have room for the chunk headers. The old
+    // format has no properties, so only plain ones can fall back to it.
+    if (root_properties.size() > 1)
+      throw std::out_of_range("superblock too large");
+    std::string superblock;
+    superblock.reserve(blocks.size()*8);
+    put_uint64(superblock, blocks.size()-1);
+    for (auto block = blocks.begin()+1; block != blocks.end(); ++block)
+      put_uint64(superblock, *block);
+    chunks.clear();
+    for (std::size_t i = 0; i < superblock.size(); i += payload)
+      chunks.push_back(superblock.substr(i, payload));
+    if ((chunks.size()+chunks_per_block-1)/chunks_per_block != offset)
+      throw std::out_of_range("superblock too large");
+  }
+
+  for (std::size_t i = 0; i < offset; i++) {
+    if (blocks[i] == 0)
+      throw std::out_of_range("unmapped block in superblock storage");
+    std::string data;
+    data.reserve(params.block_size);
+    for (std::size_t j = i*chunks_per_block;
+        j < (i+1)*chunks_per_block && j < chunks.size(); j++)
+      data += seal(chunks[j], j);
+    // unused chunks
+    std::size_t used = data.size();
+    data.resize(params.block_size);
+    random.fill(&data[used], data.size()-used);
+    dev.seek(blocks[i]*params.block_size);
+    dev.write(data);
+  }
+  _first.clear();
+}
+
+void Superblock::load(BlockDevice& dev) {
+  stats::Timer timer("superblock_load");
+  std::size_t payload = payload_size(params);
+  std::size_t chunks_per_block = params.block_size/params.chunk_size;
+  _first.clear();
+  _moved = false;
+
+  // Both copies of the root chunk if the block has room for them, which is
+  // all that has to be read to reject a wrong passphrase. Older layouts keep
+  // a single root chunk in the first slot. Every candidate location is
+  // requested at once and then tried in order.
+  std::string chunk;
+  std::uint64_t header = 0;
+  auto shadowed = [&](std::uint64_t header) {
+    return chunks_per_block >= 2 &&
+      (header == (VERSIONED | 2) || header == (VERSIONED | 3));
+  };
+  std::size_t root_slots = std::min<std::size_t>(2, chunks_per_block);
+  if (candidates.size() > 1)
+    for (auto candidate : candidates)
+      dev.prefetch(root_slots*params.chunk_size,
+          candidate*params.block_size);
+  bool found = false;
+  for (auto candidate = candidates.begin();
+      !found && candidate != candidates.end(); ++candidate) {
+    blocks.assign(1, *candidate);
+    std::string data = read_slots(dev, 0, root_slots);
+    for (std::size_t copy = 0; copy*params.chunk_size < data.size(); copy++) {
+      std::string root;
+      try {
+        root = unseal(data.substr(copy*params.chunk_size, params.chunk_size),
+            0);
+      } catch(const std::exception&) {
+        continue;
+      }
+      BufferReader reader(root);
+      std::uint64_t h = reader.le<std::uint64_t>();
+      if (!shadowed(h)) {
+        if (copy == 0) {
+          chunk = root;
+          header = h;
+          found = true;
+        }
+        continue;
+      }
+      for (int i = 0; i < 3; i++)
+        reader.varint();
+      std::uint64_t generation = reader.varint();
+      if (!shadowed(header) || generation > _generation) {
+        chunk = root;
+        header = h;
+        found = true;
+        _generation = generation;
+        _root_slot = copy;
+      }
+    }
+  }
+  if (!found)
+    throw NoSuperblock();
+
+  std::uint64_t block_count, chunks, stride = 1;
+  std::string bitmap;
+  BufferReader root(chunk);
+  root.skip(8);
   blocks.resize(1);
+  _properties.clear();
+  run_length = 1;
+  logical_iv = false;
+  disk_key.clear();
+  device_cipher.clear();
+  next_key.clear();
+  next_cipher.clear();
+  reencrypted = 0;
+  if (header & VERSIONED) {
+    if (shadowed(header))
+      stride = 2;
+    else if (header != (VERSIONED | 1) && header != (VERSIONED | 3))
+      throw std::runtime_error("unsupported superblock version");
+    block_count = root.varint();
+    offset = root.varint();
+    chunks = root.varint();
+    if (offset == 0 || chunks == 0 ||
+        chunks > offset*chunks_per_block/stride)
+      throw std::out_of_range("malformed superblock");
+    if (stride == 2) {
+      root.varint();
+      bitmap = root.string(bitmap_size(params, offset));
+    }
+    if (header == (VERSIONED | 3))
+      parse_properties(root);
+  } else {
+    block_count = header;
+    chunks = (8*(block_count+1)+payload-1)/payload;
+    offset = (chunks+chunks_per_block-1)/chunks_per_block;
+  }
   blocks.reserve(block_count+1);
-  auto blocks_per_chunk = (params.block_size-checksum_size)/8;
-  offset = (block_count+blocks_per_chunk-1)/blocks_per_chunk;
-  for (std::size_t read = checksum_size+8;
-      read < chunk.size() && blocks.size()-1 < block_count;
-      read += 8)
-    blocks.push_back(le64toh_str(chunk.substr(read, 8)));
-  // subsequent chunks
-  for (auto block = blocks.begin();
-      std::distance(blocks.begin(), block) < offset;
-      block++) {
-    if (*block == 0)
-      throw std::out_of_range("unmapped block in superblock storage");
-    cipher.reset(iv);
-    dev.seek((*block)*params.block_size);
-    chunk = cipher.decrypt(dev.read(params.block_size));
-    checksum = chunk.substr(0, hash.size());
-    std::copy_n(std::string(hash.size(), '\x00').begin(), hash.size(),
-        chunk.begin());
-    hash.update(chunk);
-    if (checksum != hash.digest())
-      throw std::runtime_error("checksum mismatch");
-    hash.reset();
-    for (std::size_t read = checksum_size;
-        read < chunk.size() && blocks.size()-1 < block_count;
-        read += 8)
-      blocks.push_back(le64toh_str(chunk.substr(read, 8)));
+  std::vector<std::uint64_t> first;
+  auto parse = [&](BufferReader& chunk) {
+    if (stride == 2 && !first.empty() && chunk.varint() != blocks.size())
+      throw std::out_of_range("malformed superblock");
+    first.push_back(blocks.size());
+    if (header & VERSIONED) {
+      decode_chunk(chunk, blocks, block_count);
+    } else {
+      while (chunk.remaining() >= 8 && blocks.size()-1 < block_count)
+        blocks.push_back(chunk.le<std::uint64_t>());
+    }
+  };
+  parse(root);
+
+  // subsequent chunks, reading as much of each block as needed at once
+  std::uint64_t last = stride*(chunks-1)+stride-1;
+  std::string data;
+  std::uint64_t data_slot = 0, data_slots = 0;
+  std::vector<bool> slots(1, _root_slot);
+  for (std::uint64_t i = 1; i < chunks; i++) {
+    std::uint64_t slot = stride*i;
+    if (stride == 2 && (bitmap[i/8] >> i%8 & 1)) {
+      slot++;
+      slots.push_back(true);
+    } else {
+      slots.push_back(false);
+    }
+    if (slot < data_slot || slot >= data_slot+data_slots) {
+      data_slot = slot;
+      data_slots = std::min<std::uint64_t>(last+1-slot,
+          chunks_per_block-slot%chunks_per_block);
+      data = read_slots(dev, data_slot, data_slots);
+    }
+    std::string contents = unseal(data.substr((slot-data_slot)*
+          params.chunk_size, params.chunk_size), i);
+    BufferReader reader(contents);
+    parse(reader);
+  }
+  if (blocks.size()-1 != block_count)
+    throw std::out_of_range("truncated superblock");
+
+  if (stride == 2) {
+    _first = first;
+    _slot = slots;
+    _dirty.assign(chunks, false);
+    _stored = blocks.size();
+    _shortest = blocks.size();
+    _offset = offset;
   }
 }
 
 std::uint64_t Superblock::size_in_blocks(const Params& params,
     std::uint64_t blocks) {
-  auto hash_size = Hash(params.hash).size();
-  auto checksum_size = (hash_size+7)/8*8;
-  auto blocks_per_chunk = (params.block_size-checksum_size)/8;
-  return (blocks+blocks_per_chunk)/blocks_per_chunk;
+  // Worst case, where every chunk falls back to raw entries
+  auto payload = payload_size(params);
+  auto chunks_per_block = params.block_size/params.chunk_size;
+  std::uint64_t copies = chunks_per_block < 2 ? 1 : 2;
+  auto chunk_entries = (payload-10-CHUNK_HEADER_MAX)/8;
+  auto size_for = [&](std::uint64_t entries, std::size_t root_header) {
+    if (payload < root_header)
+      throw std::out_of_range("superblock too large");
+    std::uint64_t root_entries = (payload-root_header)/8, chunks = 1;
+    if (entries > root_entries)
+      chunks += (entries-root_entries+chunk_entries-1)/chunk_entries;
+    return (chunks*copies+chunks_per_block-1)/chunks_per_block;
+  };
+  // The superblock also lists its own blocks after the first one, and its
+  // bitmap grows with them. Leaving both out gives a lower bound, from which
+  // the size settles within an iteration or two.
+  std::size_t root_header = ROOT_HEADER_MAX+PROPERTIES_MAX+CHUNK_HEADER_MAX;
+  std::uint64_t size = size_for(blocks, root_header), last;
+  do {
+    last = size;
+    size = size_for(blocks+size-1, root_header+
+        (copies == 2 ? bitmap_size(params, size) : 0));
+  } while (size != last);
+  return size;
+}
+
+std::uint64_t Superblock::partition_size(const Params& params,
+    std::uint64_t blocks) {
+  // The superblock only grows with the partition, so the largest partition
+  // that fits lies between these two
+  std::uint64_t low = blocks-std::min(blocks, size_in_blocks(params, blocks));
+  std::uint64_t high = blocks-std::min(blocks, size_in_blocks(params, low));
+  while (low < high) {
+    std::uint64_t middle = high-(high-low)/2;
+    if (middle+size_in_blocks(params, middle) <= blocks)
+      low = middle;
+    else
+      high = middle-1;
+  }
+  return low;
+}
+
+std::size_t Superblock::chunks() const {
+  std::size_t payload = payload_size(params);
+  std::string root_properties = properties();
+  if (params.block_size/params.chunk_size < 2) {
+    if (payload <= ROOT_HEADER_MAX+root_properties.size()+CHUNK_HEADER_MAX)
+      throw std::out_of_range("superblock too large");
+    return encode_chunks(blocks,
+        payload-ROOT_HEADER_MAX-root_properties.size(), payload,
+        false).size();
+  }
+  std::size_t root_room = payload-std::min(payload,
+      ROOT_HEADER_MAX+bitmap_size(params, offset)+root_properties.size());
+  if (root_room <= CHUNK_HEADER_MAX)
+    throw std::out_of_range("superblock too large");
+  return encode_chunks(blocks, root_room, payload-10, true).size();
 }
@@ -4,9 +4,11 @@
 #define HEADER_MAGIC_STR "\x7c\x32\xc7\x8d"
 
 #include "util.h"
+#include "buffer.h"
 #include "crypto.h"
 #include "blockdevice.h"
 #include <fstream>
+#include <map>
 #include <stdexcept>
 #include <string>
 #include <cstring>
@@ -14,28 +16,130 @@
 
 struct Params {
   std::size_t block_size, iters, key_size;
+  // Superblock chunks are packed this many bytes apart within the blocks
+  // holding the superblock. Equal to the block size in old volumes.
+  std::size_t chunk_size;
   std::string hash, device_cipher, superblock_cipher, salt;
+  // Empty for volumes created before the mode was configurable, which use
+  // CBC with a separate checksum.
+  std::string superblock_mode;
+  // Sizes in blocks of the devices of a volume that spans several, in the
+  // order blocks are numbered in: through the first device, then through the
+  // second, and so on. Every device starts with a header, and superblocks
+  // are kept on the first. Empty for a volume on a single device.
+  std::vector<std::uint64_t> devices;
+  // Tells devices of the same volume apart from others
+  std::string volume_id;
+  // Which of the devices the header is on
+  std::size_t device_index = 0;
+  // The first this many devices are faster than the rest, and hold the
+  // ranges of partitions asked to be on fast storage. 0 for a volume without
+  // tiers.
+  std::size_t fast_devices = 0;
 
   void store(BlockDevice& dev);
   void load(BlockDevice& dev);
-  std::uint64_t locate_superblock(const std::string& passphrase,
+  // Loads the header of a volume from all of its devices, given in any
+  // order, and sorts them into the order of devices
+  void load(std::vector<BlockDevice>& devs);
+  // The first block number of every device, followed by the number of
+  // blocks in the volume. device_blocks is the size of the first device.
+  std::vector<std::uint64_t> bounds(std::uint64_t device_blocks) const;
+  // The part of bounds() covering the fast devices, or the others
+  std::vector<std::uint64_t> tier_bounds(std::uint64_t device_blocks,
+      bool fast) const;
+  // Blocks the superblock of the partition with that passphrase can start
+  // at, in the order they are tried. The first is where volumes have always
+  // looked, when that is inside the volume; the others follow cheaply from
+  // the same derived key.
+  std::vector<std::uint64_t> locate_superblock(const SecureString& passphrase,
       std::uint64_t blocks) const;
+  // dm-crypt key of the partition with that passphrase
+  SecureString disk_key(const SecureString& passphrase) const;
+};
+
+// Changes to existing entries of blocks have to go through set(), and
+// removals through resize(), to be picked up by the next store; entries may
+// be appended directly.
+// Thrown by Superblock::load() when no candidate location holds a superblock
+// for the passphrase, as opposed to one that can't be read or parsed
+struct NoSuperblock : std::runtime_error {
+  NoSuperblock() : std::runtime_error("checksum mismatch") {}
 };
 
 struct Superblock {
+  // Where the root may be, blocks[0] being where it is. load() finds it,
+  // and a new partition takes the first candidate that is free.
+  std::vector<std::uint64_t> candidates;
   std::vector<std::uint64_t> blocks;
   std::size_t offset = 1;
+  // Allocation policy: data blocks were placed in runs of this many
+  // physically contiguous blocks
+  std::uint64_t run_length = 1;
+  // Whether sectors are encrypted with their offset in the partition as the
+  // IV, rather than their offset in the block. Contiguous blocks can then be
+  // mapped as a single target.
+  bool logical_iv = false;
+  // dm-crypt key and cipher of the data blocks when they no longer follow
+  // from the passphrase and the volume, empty otherwise
+  SecureString disk_key;
+  std::string device_cipher;
+  // Set while the partition is being reencrypted: the first reencrypted data
+  // entries are under next_key and next_cipher, the rest still aren't.
+  SecureString next_key;
+  std::string next_cipher;
+  std::uint64_t reencrypted = 0;
   const Params& params;
   Symmetric cipher;
-  std::string iv;
+  SecureString iv;
+  RandomStream random;
 
-  Superblock(const Params&, const std::string&, std::uint64_t);
+  Superblock(const Params&, const SecureString&, std::uint64_t);
 
+  void set(std::size_t entry, std::uint64_t block);
+  // Resizes blocks, with new entries set to block
+  void resize(std::size_t size, std::uint64_t block = 0);
+  // Copies everything but the block map from other, including properties
+  // this version doesn't know about
+  void copy_properties(const Superblock& other);
   void store(BlockDevice& dev);
+  // Throws NoSuperblock if there is none for the passphrase
   void load(BlockDevice& dev);
+  // Whether the next store keeps the current superblock readable until it
+  // is done, so that a crash during it loses nothing. Not so for superblocks
+  // with a single copy of each chunk, which are rewritten in place.
+  bool crash_safe() const;
 
   static std::uint64_t size_in_blocks(const Params& params,
       std::uint64_t blocks);
+  // Largest partition whose superblock still fits in blocks blocks with it
+  static std::uint64_t partition_size(const Params& params,
+      std::uint64_t blocks);
+  // Number of chunks store() writes for the block map as it is
+  std::size_t chunks() const;
+
+ private:
+  // Layout on disk as of the last load or store, empty if unknown
+  std::vector<std::uint64_t> _first;
+  std::vector<bool> _slot, _dirty;
+  std::uint64_t _generation = 0, _stored = 0, _offset = 0;
+  // Fewest entries since the last load or store. Chunks past it were
+  // removed, so can't be reused even if entries were appended again.
+  std::uint64_t _shortest = 0;
+  bool _root_slot = false;
+  // Whether blocks holding the superblock changed since the last store
+  bool _moved = false;
+  // Properties this version doesn't know about
+  std::map<std::uint64_t, std::string> _properties;
+
+  std::string seal(const std::string& payload, std::uint64_t index);
+  std::string unseal(const std::string& chunk, std::uint64_t index);
+  std::string properties() const;
+  void parse_properties(BufferReader& root);
+  std::string read_slots(BlockDevice& dev, std::uint64_t slot, std::size_t n);
+  void write_slot(BlockDevice& dev, std::uint64_t slot,
+      const std::string& chunk);
+  void store_unshadowed(BlockDevice& dev);
 };
 
 #endif  // HEADER_H_
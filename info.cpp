@@ -19,7 +19,7 @@ error_t init_parsers(int key, char*, argp_state* state) {
 int main(int argc, char *argv[]) {
   BlockDevice device;
 
-  auto parsers = new_subparser({"device"});
+  auto parsers = new_subparser({"readonly-device", "stats"});
   argp argp = {nullptr, init_parsers, nullptr, doc, parsers.get(), nullptr,
     nullptr};
   argp_parse(&argp, argc, argv, 0, nullptr, &device);
@@ -34,7 +34,24 @@ int main(int argc, char *argv[]) {
   std::uint64_t blocks = device.size()/params.block_size;
 
   std::cout << "Block size: " << params.block_size << " bytes" << std::endl;
-  std::cout << "Blocks total: " << blocks << std::endl;
+  std::cout << "Blocks total: " << params.bounds(blocks).back() << std::endl;
+  if (!params.devices.empty()) {
+    std::cout << "Volume ID: " << std::hex;
+    for (char c : params.volume_id) {
+      std::cout << std::setw(2) << std::setfill('0');
+      std::cout << static_cast<int>(static_cast<unsigned char>(c));
+    }
+    std::cout << std::dec << std::endl;
+    std::cout << "Devices: " << params.devices.size() << std::endl;
+    std::cout << "This device: " << params.device_index+1 << std::endl;
+    if (params.fast_devices)
+      std::cout << "Fast devices: 1 to " << params.fast_devices << std::endl;
+    for (std::size_t i = 0; i < params.devices.size(); i++)
+      std::cout << "Device " << i+1 << " blocks: " << params.devices[i]
+        << std::endl;
+  }
+  std::cout << "Superblock chunk size: " << params.chunk_size << " bytes"
+    << std::endl;
   std::cout << "PBKDF2 iterations: " << params.iters << std::endl;
   std::cout << "PBKDF2 salt: ";
   std::cout << std::hex;
@@ -48,6 +65,9 @@ int main(int argc, char *argv[]) {
   std::cout << "Encryption algorithm: " << params.device_cipher << std::endl;
   std::cout << "Superblock encryption algorithm: " << params.superblock_cipher
     << std::endl;
+  std::cout << "Superblock encryption mode: "
+    << (params.superblock_mode.empty() ? "CBC" : params.superblock_mode)
+    << std::endl;
   
   return 0;
 }
@@ -0,0 +1,50 @@
+#include "layout.h"
+#include <algorithm>
+#include <stdexcept>
+
+bool claim_location(Allocator& allocator, Superblock& superblock) {
+  auto location = std::find_if(superblock.candidates.begin(),
+      superblock.candidates.end(), [&](std::uint64_t block) {
+    return !allocator.allocated(block);
+  });
+  if (location == superblock.candidates.end())
+    return false;
+  superblock.set(0, *location);
+  allocator.mark(*location);
+  return true;
+}
+
+void lay_out(Allocator& allocator, const std::vector<std::uint64_t>& bounds,
+    Superblock& superblock, std::uint64_t blocks,
+    std::uint64_t partition_size, std::uint64_t run_length,
+    const std::vector<bool>& fast) {
+  const Params& params = superblock.params;
+  std::uint64_t offset = Superblock::size_in_blocks(params, partition_size);
+  if (blocks < offset)
+    throw std::invalid_argument("not enough blocks for the superblock");
+  superblock.offset = offset;
+  superblock.run_length = run_length;
+  superblock.logical_iv = true;
+  for (auto block : allocator.allocate(offset-1, 1, {bounds[0], bounds[1]}))
+    superblock.blocks.push_back(block);
+
+  // Runs go to each device of their tier in turn
+  std::uint64_t data_blocks = blocks-offset;
+  auto is_fast = [&](std::uint64_t i) {
+    return i < fast.size() && fast[i];
+  };
+  std::uint64_t fast_blocks = 0;
+  for (std::uint64_t i = 0; i < data_blocks && i < fast.size(); i++)
+    fast_blocks += is_fast(i);
+  std::vector<std::uint64_t> fast_tier;
+  if (fast_blocks)
+    fast_tier = allocator.allocate(fast_blocks, run_length,
+        params.tier_bounds(bounds[1], true));
+  auto slow_tier = allocator.allocate(data_blocks-fast_blocks, run_length,
+      params.tier_bounds(bounds[1], false));
+  auto next_fast = fast_tier.begin(), next_slow = slow_tier.begin();
+  for (std::uint64_t i = 0; i < data_blocks; i++)
+    superblock.blocks.push_back(is_fast(i) ? *next_fast++ : *next_slow++);
+  // Blocks past the allocation stay unmapped
+  superblock.resize(offset+partition_size, 0);
+}
@@ -0,0 +1,25 @@
+#ifndef LAYOUT_H_
+#define LAYOUT_H_
+
+#include "allocator.h"
+#include "header.h"
+#include <cstdint>
+#include <vector>
+
+// How create lays out new partitions, shared with the tools that model it
+
+// Moves the root of a new partition to the first of its candidate locations
+// that is free and marks it allocated. Returns false if none is free.
+bool claim_location(Allocator& allocator, Superblock& superblock);
+
+// Lays out a new partition whose location is claimed, partition_size blocks
+// in size with blocks of them allocated, counting its superblock's. The
+// superblock goes on the first device, below bounds[1], and data blocks in
+// runs of run_length, on the fast devices of a tiered volume where fast is
+// set for them.
+void lay_out(Allocator& allocator, const std::vector<std::uint64_t>& bounds,
+    Superblock& superblock, std::uint64_t blocks,
+    std::uint64_t partition_size, std::uint64_t run_length,
+    const std::vector<bool>& fast = std::vector<bool>());
+
+#endif  // LAYOUT_H_
@@ -0,0 +1,301 @@
+#include "mapper.h"
+#include "crypto.h"
+#include "stats.h"
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <dirent.h>
+#include <libdevmapper.h>
+
+template <class String> static String to_hex(const String& str) {
+  static const char DIGITS[] = "0123456789abcdef";
+  String ret(2*str.size(), '0');
+  for (std::size_t i = 0; i < str.size(); i++) {
+    ret[2*i] = DIGITS[static_cast<unsigned char>(str[i]) >> 4];
+    ret[2*i+1] = DIGITS[str[i] & 0xF];
+  }
+  return ret;
+}
+
+std::string hex(const std::string& str) {
+  return to_hex(str);
+}
+
+SecureString hex(const SecureString& str) {
+  return to_hex(str);
+}
+
+// "major:minor" of a device, the way dm targets refer to it
+static std::string device_number(const BlockDevice& device) {
+  return std::to_string(device.major()) + ":" + std::to_string(device.minor());
+}
+
+// Block numbers are split between the devices as params.bounds() says
+static std::vector<Target> crypt_table(const Params& params,
+    const std::vector<std::string>& devices,
+    const std::vector<std::uint64_t>& blocks, std::size_t offset,
+    std::size_t begin, std::size_t end, bool logical_iv,
+    const std::string& cipher, const SecureString& key) {
+  std::vector<Target> table;
+  SecureString hex_key = hex(key);
+  auto bounds = params.bounds(std::numeric_limits<std::uint64_t>::max());
+  // Consecutive unmapped blocks are merged into one target, and so are
+  // physically contiguous blocks if their IVs don't restart every block.
+  for (auto block = blocks.begin()+begin; block != blocks.begin()+end; ) {
+    std::uint64_t position = (block-blocks.begin()-offset)*params.block_size;
+    std::size_t device = std::upper_bound(bounds.begin()+1, bounds.end()-1,
+        *block)-bounds.begin()-1;
+    auto last = blocks.begin()+end;
+    auto next = block+1;
+    if (*block == 0) {
+      while (next != last && *next == 0)
+        ++next;
+    } else if (logical_iv) {
+      while (next != last && *next == *(next-1)+1 && *next < bounds[device+1])
+        ++next;
+    }
+    Target target;
+    target.start = position/512;
+    target.length = (next-block)*params.block_size/512;
+    if (*block != 0) {
+      std::stringstream ss;
+      ss << cipher << " ";
+      ss.write(hex_key.data(), hex_key.size());
+      ss << " ";
+      ss << (logical_iv ? position/512 : 0) << " ";
+      ss << devices.at(device) << " ";
+      ss << (*block-bounds[device])*params.block_size/512;
+      target.type = "crypt";
+      target.params = ss.str();
+    } else {
+      target.type = "error";
+    }
+    table.push_back(target);
+    block = next;
+  }
+  return table;
+}
+
+std::vector<Target> crypt_table(const Params& params,
+    const BlockDevice& device, const std::vector<std::uint64_t>& blocks,
+    std::size_t offset, std::size_t begin, std::size_t end, bool logical_iv,
+    const std::string& cipher, const SecureString& key) {
+  return crypt_table(params, std::vector<std::string>{device_number(device)},
+      blocks, offset, begin, end, logical_iv, cipher, key);
+}
+
+static std::vector<Target> partition_table(const Params& params,
+    const Superblock& superblock, const std::vector<std::string>& devices,
+    const SecureString& key) {
+  stats::Timer timer("dm_table");
+  const auto& blocks = superblock.blocks;
+  std::size_t offset = superblock.offset;
+  // Blocks already reencrypted come first
+  std::size_t split = offset;
+  std::vector<Target> table;
+  if (!superblock.next_key.empty()) {
+    split = std::min(offset+superblock.reencrypted, blocks.size());
+    table = crypt_table(params, devices, blocks, offset, offset, split,
+        superblock.logical_iv, superblock.next_cipher, superblock.next_key);
+  }
+  auto rest = crypt_table(params, devices, blocks, offset, split,
+      blocks.size(), superblock.logical_iv,
+      superblock.device_cipher.empty() ? params.device_cipher :
+        superblock.device_cipher,
+      superblock.disk_key.empty() ? key : superblock.disk_key);
+  table.insert(table.end(), rest.begin(), rest.end());
+  return table;
+}
+
+std::vector<Target> partition_table(const Params& params,
+    const Superblock& superblock, const BlockDevice& device,
+    const SecureString& key) {
+  return partition_table(params, superblock,
+      std::vector<std::string>{device_number(device)}, key);
+}
+
+std::vector<Target> partition_table(const Params& params,
+    const Superblock& superblock, const std::vector<BlockDevice>& devices,
+    const SecureString& key) {
+  std::vector<std::string> numbers;
+  for (const auto& device : devices)
+    numbers.push_back(device_number(device));
+  return partition_table(params, superblock, numbers, key);
+}
+
+// Sizes of struct dm_ioctl and struct dm_target_spec
+static const std::uint64_t DM_IOCTL_SIZE = 312;
+static const std::uint64_t DM_TARGET_SPEC_SIZE = 40;
+
+std::uint64_t table_size(const std::vector<Target>& table) {
+  std::uint64_t size = DM_IOCTL_SIZE;
+  // Every target's parameters follow its spec, null-terminated and padded to
+  // 8 bytes
+  for (const auto& target : table)
+    size += DM_TARGET_SPEC_SIZE+(target.params.size()+1+7)/8*8;
+  return size;
+}
+
+std::string default_name(const Params& params, const SecureString& key) {
+  Hash hash(params.hash, true);
+  hash.update(key);
+  return hex(hash.digest()).substr(8);
+}
+
+typedef std::unique_ptr<dm_task, void(*)(dm_task*)> dm_task_ptr;
+
+static dm_task_ptr dm_task_new(int type, const std::string& name) {
+  dm_task_ptr dmt(dm_task_create(type), dm_task_destroy);
+  if (!dmt.get())
+    throw std::runtime_error("dm_task_create failed");
+  if (!dm_task_set_name(dmt.get(), name.c_str()))
+    throw std::runtime_error("dm_task_set_name failed");
+  return dmt;
+}
+
+// Tables hold keys in hex, so libdevmapper has to wipe its copies of them
+static void secure_data(dm_task* dmt) {
+  if (!dm_task_secure_data(dmt))
+    throw std::runtime_error("dm_task_secure_data failed");
+}
+
+static void dm_task_add_targets(dm_task* dmt,
+    const std::vector<Target>& table) {
+  for (const auto& target : table)
+    if (!dm_task_add_target(dmt, target.start, target.length,
+          target.type.c_str(), target.params.c_str()))
+      throw std::runtime_error("dm_task_add_target(\"" + target.type +
+          "\") failed");
+}
+
+bool dm_exists(const std::string& name) {
+  stats::Timer timer("dm_info");
+  auto dmt = dm_task_new(DM_DEVICE_INFO, name);
+  dm_info info;
+  if (!dm_task_run(dmt.get()) || !dm_task_get_info(dmt.get(), &info))
+    throw std::runtime_error("dm_task_run failed");
+  return info.exists;
+}
+
+// Runs a task that adds or removes a device node, and waits for udev
+static void dm_task_run_udev(dm_task* dmt) {
+  std::uint32_t cookie = 0;
+  if (!dm_task_set_cookie(dmt, &cookie, 0))
+    throw std::runtime_error("dm_task_set_cookie failed");
+  bool ok = dm_task_run(dmt);
+  dm_udev_wait(cookie);
+  if (!ok)
+    throw std::runtime_error("dm_task_run failed");
+}
+
+void dm_create(const std::string& name, const std::vector<Target>& table) {
+  stats::Timer timer("dm_create");
+  auto dmt = dm_task_new(DM_DEVICE_CREATE, name);
+  secure_data(dmt.get());
+  dm_task_add_targets(dmt.get(), table);
+  dm_task_run_udev(dmt.get());
+}
+
+void dm_remove(const std::string& name) {
+  stats::Timer timer("dm_remove");
+  auto dmt = dm_task_new(DM_DEVICE_REMOVE, name);
+  dm_task_run_udev(dmt.get());
+}
+
+void dm_reload(const std::string& name, const std::vector<Target>& table) {
+  stats::Timer timer("dm_reload");
+  auto dmt = dm_task_new(DM_DEVICE_RELOAD, name);
+  secure_data(dmt.get());
+  dm_task_add_targets(dmt.get(), table);
+  if (!dm_task_run(dmt.get()))
+    throw std::runtime_error("dm_task_run(DM_DEVICE_RELOAD) failed");
+}
+
+void dm_suspend(const std::string& name) {
+  stats::Timer timer("dm_suspend");
+  auto dmt = dm_task_new(DM_DEVICE_SUSPEND, name);
+  if (!dm_task_run(dmt.get()))
+    throw std::runtime_error("dm_task_run(DM_DEVICE_SUSPEND) failed");
+}
+
+void dm_resume(const std::string& name) {
+  stats::Timer timer("dm_resume");
+  auto dmt = dm_task_new(DM_DEVICE_RESUME, name);
+  if (!dm_task_run(dmt.get()))
+    throw std::runtime_error("dm_task_run(DM_DEVICE_RESUME) failed");
+}
+
+std::string dm_message(const std::string& name, const std::string& message) {
+  stats::Timer timer("dm_message");
+  auto dmt = dm_task_new(DM_DEVICE_TARGET_MSG, name);
+  if (!dm_task_set_sector(dmt.get(), 0))
+    throw std::runtime_error("dm_task_set_sector failed");
+  if (!dm_task_set_message(dmt.get(), message.c_str()))
+    throw std::runtime_error("dm_task_set_message failed");
+  if (!dm_task_run(dmt.get()))
+    throw std::runtime_error("dm_task_run(DM_DEVICE_TARGET_MSG) failed");
+  const char* response = dm_task_get_message_response(dmt.get());
+  return response ? response : "";
+}
+
+std::vector<std::string> dm_holders(const Params& params,
+    const BlockDevice& device, const std::vector<std::uint64_t>& blocks) {
+  std::vector<std::string> names;
+  std::string path = "/sys/dev/block/" + device_number(device) + "/holders";
+  std::unique_ptr<DIR, int(*)(DIR*)> dir(opendir(path.c_str()), closedir);
+  if (!dir.get())
+    return names;
+  std::vector<std::uint64_t> sorted(blocks);
+  std::sort(sorted.begin(), sorted.end());
+  while (dirent* entry = readdir(dir.get())) {
+    std::string holder = entry->d_name;
+    if (holder.compare(0, 3, "dm-") != 0)
+      continue;
+    std::ifstream file("/sys/block/" + holder + "/dm/name");
+    std::string name;
+    if (!std::getline(file, name))
+      continue;
+    stats::Timer timer("dm_table");
+    auto dmt = dm_task_new(DM_DEVICE_TABLE, name);
+    secure_data(dmt.get());
+    if (!dm_task_run(dmt.get()))
+      throw std::runtime_error("dm_task_run(DM_DEVICE_TABLE) failed");
+    void* next = nullptr;
+    do {
+      std::uint64_t start, length;
+      char* type = nullptr;
+      char* target = nullptr;
+      next = dm_get_next_target(dmt.get(), next, &start, &length, &type,
+          &target);
+      if (!type || std::string(type) != "crypt" || !target)
+        continue;
+      // "cipher key iv_offset major:minor offset", skipping past the key
+      // without copying it
+      const char* p = target;
+      for (int field = 0; field < 3 && p; field++)
+        if ((p = std::strchr(p, ' ')))
+          p++;
+      unsigned major, minor;
+      std::uint64_t sector;
+      if (!p ||
+          std::sscanf(p, "%u:%u %" SCNu64, &major, &minor, &sector) != 3 ||
+          major != device.major() || minor != device.minor())
+        continue;
+      std::uint64_t first = sector*512/params.block_size;
+      std::uint64_t last = ((sector+length)*512+params.block_size-1)/
+        params.block_size;
+      auto block = std::lower_bound(sorted.begin(), sorted.end(), first);
+      if (block != sorted.end() && *block < last) {
+        names.push_back(name);
+        break;
+      }
+    } while (next);
+  }
+  return names;
+}
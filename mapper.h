@@ -0,0 +1,57 @@
+#ifndef MAPPER_H_
+#define MAPPER_H_
+
+#include "blockdevice.h"
+#include "header.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// A device-mapper target, with start and length in 512-byte sectors
+struct Target {
+  std::uint64_t start, length;
+  std::string type, params;
+};
+
+std::string hex(const std::string&);
+SecureString hex(const SecureString&);
+
+// Targets for entries begin to end of blocks, a partition's block map with
+// data entries from offset on, encrypted with cipher and key. Entries that
+// are 0 are unmapped.
+std::vector<Target> crypt_table(const Params& params,
+    const BlockDevice& device, const std::vector<std::uint64_t>& blocks,
+    std::size_t offset, std::size_t begin, std::size_t end, bool logical_iv,
+    const std::string& cipher, const SecureString& key);
+// Targets mapping the partition described by superblock on device, where key
+// is the one derived from its passphrase
+std::vector<Target> partition_table(const Params& params,
+    const Superblock& superblock, const BlockDevice& device,
+    const SecureString& key);
+// Same for a volume on several devices, in the order Params::load sorts them
+// into
+std::vector<Target> partition_table(const Params& params,
+    const Superblock& superblock, const std::vector<BlockDevice>& devices,
+    const SecureString& key);
+// Bytes of the ioctl that passes table to the kernel
+std::uint64_t table_size(const std::vector<Target>& table);
+// Name under /dev/mapper to use when none is given
+std::string default_name(const Params& params, const SecureString& key);
+
+bool dm_exists(const std::string& name);
+// Returns once the device node exists
+void dm_create(const std::string& name, const std::vector<Target>& table);
+void dm_remove(const std::string& name);
+// Loads table to be swapped in on the next resume
+void dm_reload(const std::string& name, const std::vector<Target>& table);
+void dm_suspend(const std::string& name);
+void dm_resume(const std::string& name);
+// Sends message to the target at sector 0 and returns its reply, used for dm
+// statistics
+std::string dm_message(const std::string& name, const std::string& message);
+// Names of the device-mapper devices stacked on device with a crypt target
+// on any of blocks, such as a partition open under a name not given
+std::vector<std::string> dm_holders(const Params& params,
+    const BlockDevice& device, const std::vector<std::uint64_t>& blocks);
+
+#endif  // MAPPER_H_
@@ -1,15 +1,13 @@
 #include "blockdevice.h"
 #include "header.h"
 #include "pinentry.h"
-#include "PBKDF2.h"
+#include "mapper.h"
 #include "argp-parsers.h"
 #include <argp.h>
 #include <iostream>
-#include <iomanip>
-#include <sstream>
-#include <libdevmapper.h>
 
-const char* doc = "Open an encrypted partition on DEVICE";
+const char* doc = "Open an encrypted partition on DEVICE\vA volume on "
+  "several devices takes all of them, in any order.";
 
 argp_option options[] = {
   {"name", 'n', "NAME", 0, "NAME is the device to create under /dev/mapper", 0},
@@ -17,7 +15,7 @@ argp_option options[] = {
 };
 
 struct State {
-  BlockDevice device;
+  std::vector<BlockDevice> devices;
   std::string name;
 };
 
@@ -28,7 +26,7 @@ error_t init_parsers(int key, char* arg, argp_state* state) {
       args.name = arg;
       break;
    case ARGP_KEY_INIT:
-      state->child_inputs[0] = &args.device;
+      state->child_inputs[0] = &args.devices;
       break;
     default:
       return ARGP_ERR_UNKNOWN;
@@ -36,19 +34,10 @@ error_t init_parsers(int key, char* arg, argp_state* state) {
   return 0;
 }
 
-std::string hex(const std::string& str) {
-  std::stringstream ss;
-  ss << std::hex;
-  for (char c : str)
-    ss << std::setw(2) << std::setfill('0')
-      << static_cast<int>(static_cast<unsigned char>(c));
-  return ss.str();
-}
-
 int main(int argc, char *argv[])
   try {
     State state;
-    auto parsers = new_subparser({"device"});
+    auto parsers = new_subparser({"devices", "stats"});
     argp argp = {options, init_parsers, nullptr, doc, parsers.get(), nullptr,
       nullptr};
     argp_parse(&argp, argc, argv, 0, nullptr, &state);
@@ -56,12 +45,17 @@ int main(int argc, char *argv[])
     Params params;
 
     try {
-      params.load(state.device);
+      params.load(state.devices);
     } catch(const std::exception& e) {
-      std::cerr << "Error: Header corrupt." << std::endl;
+      if (state.devices.size() > 1)
+        std::cerr << "Error: " << e.what() << "." << std::endl;
+      else
+        std::cerr << "Error: Header corrupt." << std::endl;
       return 1;
     }
-    std::uint64_t blocks = state.device.size()/params.block_size;
+    BlockDevice& device = state.devices.front();
+    // Superblocks are all on the first device
+    std::uint64_t blocks = params.bounds(device.size()/params.block_size)[1];
 
     Pinentry pinentry;
     pinentry.SETDESC("Enter passphrases for a partition on this volume.");
@@ -69,48 +63,18 @@ int main(int argc, char *argv[])
     auto passphrase = pinentry.GETPIN();
     Superblock superblock(params, passphrase, blocks);
     try {
-      superblock.load(state.device);
+      superblock.load(device);
     } catch(...) {
       std::cerr << "Error: No partition found for that passphrase." << std::endl;
+      return 1;
     }
-    Hash hash(params.hash);
-    std::string key = PBKDF2::PBKDF2(hash, passphrase, params.salt,
-        params.iters, params.key_size);
+    SecureString key = params.disk_key(passphrase);
 
-    if (state.name.empty()) {
-      hash.reset();
-      hash.update(key);
-      state.name = hex(hash.digest()).substr(8);
-    }
+    if (state.name.empty())
+      state.name = default_name(params, key);
 
-    {
-      std::unique_ptr<dm_task, void(*)(dm_task*)> dmt(
-          dm_task_create(DM_DEVICE_CREATE), dm_task_destroy);
-      if (!dmt.get())
-        throw std::runtime_error("dm_task_create failed");
-      if (!dm_task_set_name(dmt.get(), state.name.c_str()))
-        throw std::runtime_error("dm_task_set_name failed");
-      std::uint64_t offset = 0;
-      for (auto block = superblock.blocks.begin()+superblock.offset;
-          block != superblock.blocks.end();
-          block++, offset += params.block_size) {
-        if (*block != 0) {
-          std::stringstream ss;
-          ss << params.device_cipher << " " << hex(key) << " 0 ";
-          ss << state.device.major() << ":" << state.device.minor() << " ";
-          ss << (*block)*params.block_size/512;
-          if (!dm_task_add_target(dmt.get(), offset/512, params.block_size/512,
-                "crypt", ss.str().c_str()))
-            throw std::runtime_error("dm_task_add_target(\"crypt\") failed");
-        } else {
-          if (!dm_task_add_target(dmt.get(), offset/512, params.block_size/512,
-                "error", ""))
-            throw std::runtime_error("dm_task_add_target(\"error\") failed");
-        }
-      }
-      if (!dm_task_run(dmt.get()))
-        throw std::runtime_error("dm_task_run failed");
-    }
+    dm_create(state.name, partition_table(params, superblock, state.devices,
+          key));
 
     return 0;
   } catch(const std::exception& e) {
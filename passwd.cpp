@@ -0,0 +1,142 @@
+#include "allocator.h"
+#include "blockdevice.h"
+#include "header.h"
+#include "pinentry.h"
+#include "argp-parsers.h"
+#include <argp.h>
+#include <iostream>
+#include <algorithm>
+
+const char* doc = "Change the passphrase of an encrypted partition on "
+  "DEVICE\vOnly the superblock moves: data stays where it is, under the key "
+  "it was written with. Run reencrypt afterwards to change that key too. A "
+  "volume on several devices takes all of them, in any order.";
+
+error_t init_parsers(int key, char*, argp_state* state) {
+  if (key == ARGP_KEY_INIT) {
+    state->child_inputs[0] = state->input;
+    return 0;
+  }
+  return ARGP_ERR_UNKNOWN;
+}
+
+int main(int argc, char *argv[])
+  try {
+    std::vector<BlockDevice> devices;
+    auto parsers = new_subparser({"devices", "stats"});
+    argp argp = {nullptr, init_parsers, nullptr, doc, parsers.get(), nullptr,
+      nullptr};
+    argp_parse(&argp, argc, argv, 0, nullptr, &devices);
+
+    Params params;
+
+    try {
+      params.load(devices);
+    } catch(const std::exception& e) {
+      if (devices.size() > 1)
+        std::cerr << "Error: " << e.what() << "." << std::endl;
+      else
+        std::cerr << "Error: Header corrupt." << std::endl;
+      return 1;
+    }
+    BlockDevice& device = devices.front();
+    // Superblocks are all on the first device
+    auto bounds = params.bounds(device.size()/params.block_size);
+
+    Allocator allocator(bounds.back());
+    for (std::size_t i = 0; i+1 < bounds.size(); i++)
+      allocator.mark(bounds[i]);
+
+    SecureString passphrase;
+    Pinentry pinentry;
+    pinentry.SETDESC("Enter passphrases for all other partitions on this "
+        "volume. Enter an empty passphrase after last passphrase.");
+    pinentry.SETPROMPT("Passphrase:");
+    while ((passphrase = pinentry.GETPIN()) != "") {
+      Superblock superblock(params, passphrase, bounds[1]);
+      try {
+        superblock.load(device);
+        for (auto block : superblock.blocks)
+          allocator.mark(block);
+      } catch(...) {
+        pinentry.SETERROR("No partition found for that passphrase.");
+      }
+    }
+
+    pinentry.SETDESC("Enter the current passphrase of the partition.");
+    passphrase = pinentry.GETPIN();
+    Superblock old_superblock(params, passphrase, bounds[1]);
+    try {
+      old_superblock.load(device);
+    } catch(...) {
+      std::cerr << "Error: No partition found for that passphrase." << std::endl;
+      return 1;
+    }
+    for (auto block : old_superblock.blocks)
+      if (block != 0)
+        allocator.mark(block);
+
+    pinentry.SETDESC("Enter the new passphrase of the partition.");
+    SecureString new_passphrase = pinentry.GETPIN();
+    pinentry.SETDESC("Repeat the new passphrase.");
+    if (new_passphrase.empty() || pinentry.GETPIN() != new_passphrase) {
+      std::cerr << "Error: The new passphrases don't match." << std::endl;
+      return 1;
+    }
+
+    try {
+      Superblock(params, new_passphrase, bounds[1]).load(device);
+      std::cerr << "Error: That passphrase already opens a partition."
+        << std::endl;
+      return 1;
+    } catch(const NoSuperblock&) {
+    } catch(const std::exception& e) {
+      std::cerr << "Error: Can't tell whether that passphrase opens a "
+        "partition already: " << e.what() << "." << std::endl;
+      return 1;
+    }
+    Superblock superblock(params, new_passphrase, bounds[1]);
+    auto location = std::find_if(superblock.candidates.begin(),
+        superblock.candidates.end(), [&](std::uint64_t block) {
+      return !allocator.allocated(block);
+    });
+    if (location == superblock.candidates.end()) {
+      std::cerr << "Error: Every superblock location of the new passphrase "
+        "is already in use." << std::endl;
+      return 1;
+    }
+    allocator.mark(*location);
+
+    // Data stays under the key it is encrypted with, which no longer follows
+    // from the passphrase
+    superblock.copy_properties(old_superblock);
+    if (superblock.disk_key.empty())
+      superblock.disk_key = params.disk_key(passphrase);
+    superblock.blocks.assign(1, *location);
+    superblock.offset = old_superblock.offset;
+    for (auto block : allocator.allocate(superblock.offset-1, 1,
+          {bounds[0], bounds[1]}))
+      superblock.blocks.push_back(block);
+    superblock.blocks.insert(superblock.blocks.end(),
+        old_superblock.blocks.begin()+old_superblock.offset,
+        old_superblock.blocks.end());
+    superblock.store(device);
+    device.sync();
+
+    // The old superblock is overwritten like a free block, so the old
+    // passphrase opens nothing
+    RandomStream random;
+    std::string noise(params.block_size, '\0');
+    for (std::size_t i = 0; i < old_superblock.offset; i++) {
+      random.fill(&noise[0], noise.size());
+      device.pwrite(noise.data(), noise.size(),
+          old_superblock.blocks[i]*params.block_size);
+    }
+    device.sync();
+
+    std::cout << "Passphrase changed." << std::endl;
+    return 0;
+  } catch(const std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
@@ -68,13 +68,13 @@ bool Pinentry::CONFIRM() {
 }
 
 static gpg_error_t set_string(void *arg, const void *data, size_t len) {
-  std::string *str = reinterpret_cast<std::string*>(arg);
+  SecureString *str = reinterpret_cast<SecureString*>(arg);
   str->assign(reinterpret_cast<const char*>(data), len);
   return GPG_ERR_NO_ERROR;
 }
 
-std::string Pinentry::GETPIN() {
-  std::string ret;
+SecureString Pinentry::GETPIN() {
+  SecureString ret;
   gpg_error_t error;
   if ((error = assuan_transact(_pinentry, "GETPIN",
           set_string, &ret,  // data callback
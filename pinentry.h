@@ -1,6 +1,7 @@
 #ifndef PINENTRY_H_
 #define PINENTRY_H_
 
+#include "crypto.h"
 #include <assuan.h>
 #include <string>
 
@@ -18,7 +19,7 @@ class Pinentry {
   void SETERROR(const std::string&);
   void SETQUALITYBAR();
   void SETQUALITYBAR_TT(const std::string&);
-  std::string GETPIN();
+  SecureString GETPIN();
   bool CONFIRM();
   void MESSAGE();
 
@@ -0,0 +1,235 @@
+#include "allocator.h"
+#include "blockdevice.h"
+#include "header.h"
+#include "layout.h"
+#include "mapper.h"
+#include "PBKDF2.h"
+#include "argp-parsers.h"
+#include <argp.h>
+#include <iostream>
+#include <algorithm>
+
+const char* doc = "Show how a partition created with the given sizes would \
+be laid out and what opening it would cost, without writing anything\v\
+The volume is either the one on every DEVICE given, or one modelled from \
+--size and the header options, which take the same defaults as format. \
+Partitions already on a volume aren't counted, so its space is taken as \
+free.\n\n\
+The layout is an example of one create would make. Blocks are placed at \
+random and the superblock where a model passphrase puts it, so counts that \
+depend on where blocks land, such as targets, vary between runs and from \
+the partition create makes.\n\n\
+Kernel memory is an estimate from the memory pools dm-crypt sets up for \
+every target.";
+
+argp_option options[] = {
+  {"size", 'S', "BYTES", 0, "Model a volume on a device of BYTES bytes, with "
+    "an optional K, M, G, T or P suffix. Given more than once, the volume "
+    "spans a device of each size.", 0},
+  {"blocks", 'a', "BLOCKS", 0, "Number of blocks to allocate for the "
+    "partition", 0},
+  {"partition-size", 'p', "BLOCKS", 0, "Size of the partition in blocks", 0},
+  {"run-length", 'r', "BLOCKS", 0, "Place the partition in runs of BLOCKS "
+    "physically contiguous blocks", 0},
+  {nullptr, 0, nullptr, 0, nullptr, 0}
+};
+
+struct State {
+  Params params;
+  std::vector<std::uint64_t> sizes;
+  std::uint64_t blocks = 0;
+  std::uint64_t partition_size = 0;
+  std::uint64_t run_length = 1;
+  std::vector<BlockDevice> devices;
+};
+
+error_t init_parsers(int key, char* arg, argp_state* state) {
+  State& args = *reinterpret_cast<State*>(state->input);
+  switch (key) {
+    case 'S':
+      try {
+        args.sizes.push_back(parse_size(arg));
+      } catch(const std::exception& e) {
+        argp_failure(state, 1, 0, e.what());
+      }
+      if (args.sizes.back() == 0)
+        argp_failure(state, 1, 0, "Size must be positive");
+      break;
+    case 'a':
+      args.blocks = std::max<std::int64_t>(from_string<std::int64_t>(arg), 0);
+      if (args.blocks == 0)
+        argp_failure(state, 1, 0, "Number of blocks must be positive");
+      break;
+    case 'p':
+      args.partition_size = std::max<std::int64_t>(
+          from_string<std::int64_t>(arg), 0);
+      if (args.partition_size == 0)
+        argp_failure(state, 1, 0, "Partition size must be positive");
+      break;
+    case 'r':
+      args.run_length = std::max<std::int64_t>(from_string<std::int64_t>(arg),
+          0);
+      if (args.run_length == 0)
+        argp_failure(state, 1, 0, "Run length must be positive");
+      break;
+    case ARGP_KEY_ARG:
+      try {
+        args.devices.emplace_back(arg, true);
+      } catch(const std::exception& e) {
+        argp_failure(state, 1, 0, e.what());
+      }
+      break;
+    case ARGP_KEY_END:
+      if (args.devices.empty() == args.sizes.empty())
+        argp_failure(state, 1, 0, "Give either DEVICE or --size");
+      break;
+    case ARGP_KEY_INIT:
+      state->child_inputs[0] = &args.params;
+      break;
+    default:
+      return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
+
+// What the kernel keeps for a loaded table: every dm-crypt target
+// preallocates a pool of BIO_MAX_VECS pages and pools of requests and bios,
+// and every target takes an entry in the table.
+static const std::uint64_t CRYPT_TARGET_MEMORY = (256 << 12)+(64 << 10);
+static const std::uint64_t TARGET_MEMORY = 256;
+
+int main(int argc, char *argv[])
+  try {
+    State state;
+    state.params.block_size = 4 << 20;
+    state.params.chunk_size = 64 << 10;
+    state.params.iters = 1000;
+    state.params.key_size = 256/8;
+    state.params.hash = "SHA256";
+    state.params.device_cipher = "aes-cbc-essiv:sha256";
+    state.params.superblock_cipher = "AES256";
+    state.params.superblock_mode = "GCM";
+    state.params.salt = nonce(16);
+
+    auto parsers = new_subparser({"params", "stats"});
+    argp argp = {options, init_parsers, "[DEVICE...]", doc, parsers.get(),
+      nullptr, nullptr};
+    argp_parse(&argp, argc, argv, 0, nullptr, &state);
+
+    Params& params = state.params;
+    Hash hash(params.hash);
+    std::size_t rate = PBKDF2::benchmark(hash, 100);
+    std::vector<std::uint64_t> bounds;
+    if (state.devices.empty()) {
+      params.chunk_size = std::min(params.chunk_size, params.block_size);
+      if (params.block_size % params.chunk_size != 0) {
+        std::cerr << "Error: Chunk size must divide the block size."
+          << std::endl;
+        return 1;
+      }
+      // Iterations as format would pick them on this machine
+      params.iters = std::max<std::size_t>(rate*params.iters/100/
+          ((params.key_size+hash.size()-1)/hash.size()), 1);
+      if (state.sizes.size() > 1)
+        for (auto size : state.sizes)
+          params.devices.push_back(size/params.block_size);
+      bounds = params.bounds(state.sizes.front()/params.block_size);
+      // Only the device numbers in the table come from these
+      for (std::size_t i = 0; i+1 < bounds.size(); i++)
+        state.devices.push_back(BlockDevice::memory(0));
+    } else {
+      try {
+        params.load(state.devices);
+      } catch(const std::exception& e) {
+        if (state.devices.size() > 1)
+          std::cerr << "Error: " << e.what() << "." << std::endl;
+        else
+          std::cerr << "Error: Header corrupt." << std::endl;
+        return 1;
+      }
+      bounds = params.bounds(state.devices.front().size()/params.block_size);
+    }
+    if (bounds[1] <= 1) {
+      std::cerr << "Error: No room for any partitions." << std::endl;
+      return 1;
+    }
+
+    Allocator allocator(bounds.back());
+    for (std::size_t i = 0; i+1 < bounds.size(); i++)
+      allocator.mark(bounds[i]);
+    std::uint64_t free_blocks = allocator.free();
+    std::uint64_t blocks = state.blocks ? state.blocks : free_blocks;
+    std::uint64_t partition_size = state.partition_size ?
+      state.partition_size : Superblock::partition_size(params, blocks);
+    std::uint64_t offset = Superblock::size_in_blocks(params, partition_size);
+    blocks = std::min(blocks, partition_size+offset);
+    if (blocks > free_blocks) {
+      std::cerr << "Error: not enough free space." << std::endl;
+      return 1;
+    }
+    if (blocks < offset) {
+      std::cerr << "Error: not enough blocks for the header of the partition."
+        << std::endl;
+      return 1;
+    }
+
+    // Laid out by the same code as create. The superblock goes where a model
+    // passphrase puts it, derived with a single iteration.
+    Params model = params;
+    model.iters = 1;
+    Superblock superblock(model, "plan", bounds[1]);
+    if (!claim_location(allocator, superblock)) {
+      std::cerr << "Error: No room for the superblock." << std::endl;
+      return 1;
+    }
+    lay_out(allocator, bounds, superblock, blocks, partition_size,
+        state.run_length);
+
+    std::size_t chunks_per_block = params.block_size/params.chunk_size;
+    std::size_t chunks = superblock.chunks();
+    std::size_t capacity = chunks_per_block < 2 ? offset :
+      offset*chunks_per_block/2;
+
+    auto table = partition_table(params, superblock, state.devices,
+        SecureString(params.key_size, '\0'));
+    std::uint64_t crypt_targets = std::count_if(table.begin(), table.end(),
+        [](const Target& target) { return target.type == "crypt"; });
+    std::uint64_t error_targets = table.size()-crypt_targets;
+    std::uint64_t memory = crypt_targets*CRYPT_TARGET_MEMORY+
+      (crypt_targets+error_targets)*TARGET_MEMORY;
+
+    // Opening derives the superblock location, the superblock key and the
+    // disk key, each a PBKDF2 block of params.iters iterations per hash
+    // output
+    Symmetric cipher(params.superblock_cipher,
+        cipher_mode(params.superblock_mode));
+    std::size_t superblock_key = cipher.key_size()+
+      (cipher.aead() ? 0 : cipher.block_size());
+    std::size_t derivations = 1+(superblock_key+hash.size()-1)/hash.size()+
+      (params.key_size+hash.size()-1)/hash.size();
+
+    std::cout << "Block size: " << params.block_size << " bytes" << std::endl;
+    std::cout << "Blocks free: " << free_blocks << std::endl;
+    std::cout << "Blocks allocated: " << blocks << std::endl;
+    std::cout << "Partition size: " << partition_size << " blocks"
+      << std::endl;
+    std::cout << "Superblock blocks: " << offset << std::endl;
+    std::cout << "Superblock chunks: " << chunks << " of " << capacity
+      << std::endl;
+    std::cout << "Superblock location: block " << superblock.blocks.front()
+      << " (for a model passphrase)" << std::endl;
+    std::cout << "Targets: " << crypt_targets+error_targets << " ("
+      << crypt_targets << " crypt, " << error_targets << " error)"
+      << std::endl;
+    std::cout << "Table size: " << table_size(table) << " bytes" << std::endl;
+    std::cout << "Kernel memory: about " << (memory+(1 << 20)-1)/(1 << 20)
+      << " MiB" << std::endl;
+    std::cout << "PBKDF2 iterations: " << params.iters << std::endl;
+    std::cout << "Unlock time: about " << derivations*params.iters*100/
+      std::max<std::size_t>(rate, 1) << " ms (" << derivations
+      << " PBKDF2 blocks)" << std::endl;
+    return 0;
+  } catch(const std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
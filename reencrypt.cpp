@@ -0,0 +1,317 @@
+#include "allocator.h"
+#include "blockdevice.h"
+#include "copy.h"
+#include "header.h"
+#include "mapper.h"
+#include "pinentry.h"
+#include "argp-parsers.h"
+#include <argp.h>
+#include <iostream>
+#include <limits>
+#include <algorithm>
+
+const char* doc = "Reencrypt a partition on DEVICE under a new random disk "
+  "key\vBlocks are moved one batch at a time to free blocks under the new "
+  "key, so only a batch worth of free space is needed. An interrupted "
+  "reencryption is resumed by running this again.";
+
+argp_option options[] = {
+  {"name", 'n', "NAME", 0, "NAME is the device the partition is open as "
+    "under /dev/mapper, if not the default one", 0},
+  {"cipher", 'c', "CIPHER", 0, "New cipher for the partition (see "
+    "/proc/crypto). Defaults to the current one.", 0},
+  {"key-size", 's', "BITS", 0, "New disk encryption key size. Defaults to "
+    "the one of the volume.", 0},
+  {"batch", 'B', "BLOCKS", 0, "Number of blocks to reencrypt between "
+    "superblock updates", 0},
+  {"threads", 'j', "N", 0, "Number of requests in flight", 0},
+  {"bandwidth", 'l', "MIB", 0, "Reencrypt at most MIB mebibytes per second",
+    0},
+  {"force", 'f', nullptr, 0, "Reencrypt even if the superblock is "
+    "rewritten in place, as on volumes with a single copy of each "
+    "superblock chunk. A crash while reencrypting then loses the "
+    "partition.", 0},
+  {nullptr, 0, nullptr, 0, nullptr, 0}
+};
+
+struct State {
+  std::string name, cipher;
+  std::size_t key_size = 0;
+  std::uint64_t batch = 64;
+  unsigned threads = 4;
+  std::uint64_t bandwidth = 0;
+  bool force = false;
+  BlockDevice device;
+};
+
+error_t init_parsers(int key, char* arg, argp_state* state) {
+  State& args = *reinterpret_cast<State*>(state->input);
+  switch (key) {
+    case 'n':
+      args.name = arg;
+      break;
+    case 'c':
+      args.cipher = arg;
+      break;
+    case 's': {
+        auto size = from_string<std::int64_t>(arg);
+        if (size <= 0 || size % 8 != 0)
+          argp_failure(state, 1, 0, "Key size must be a positive multiple "
+              "of 8");
+        args.key_size = size/8;
+        break;
+      }
+    case 'B':
+      args.batch = std::max<std::int64_t>(from_string<std::int64_t>(arg), 0);
+      if (args.batch == 0)
+        argp_failure(state, 1, 0, "Batch size must be positive");
+      break;
+    case 'j':
+      args.threads = std::max<std::int64_t>(from_string<std::int64_t>(arg), 0);
+      if (args.threads == 0)
+        argp_failure(state, 1, 0, "Number of threads must be positive");
+      break;
+    case 'l':
+      args.bandwidth = std::max<std::int64_t>(from_string<std::int64_t>(arg),
+          0);
+      if (args.bandwidth == 0)
+        argp_failure(state, 1, 0, "Bandwidth must be positive");
+      if (args.bandwidth > std::numeric_limits<std::int64_t>::max() >> 20)
+        argp_failure(state, 1, 0, "Bandwidth too large");
+      args.bandwidth <<= 20;
+      break;
+    case 'f':
+      args.force = true;
+      break;
+    case ARGP_KEY_INIT:
+      state->child_inputs[0] = &args.device;
+      break;
+    default:
+      return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
+
+// A device-mapper device that is removed again when this goes out of scope
+struct TemporaryDevice {
+  std::string name;
+  BlockDevice device;
+
+  TemporaryDevice(const std::string& name, const std::vector<Target>& table)
+      : name(name) {
+    dm_create(name, table);
+    try {
+      device = BlockDevice("/dev/mapper/" + name);
+      // Nothing read or written through it is ever needed again
+      device.direct(true);
+    } catch(...) {
+      dm_remove(name);
+      throw;
+    }
+  }
+
+  ~TemporaryDevice() {
+    device = BlockDevice();
+    try {
+      dm_remove(name);
+    } catch(const std::exception& e) {
+      std::cerr << "Warning: can't remove " << name << ": " << e.what()
+        << std::endl;
+    }
+  }
+};
+
+int main(int argc, char *argv[])
+  try {
+    State state;
+    auto parsers = new_subparser({"device", "stats"});
+    argp argp = {options, init_parsers, nullptr, doc, parsers.get(), nullptr,
+      nullptr};
+    argp_parse(&argp, argc, argv, 0, nullptr, &state);
+
+    Params params;
+
+    try {
+      params.load(state.device);
+    } catch(const std::exception& e) {
+      std::cerr << "Error: Header corrupt." << std::endl;
+      return 1;
+    }
+    if (!params.devices.empty()) {
+      std::cerr << "Error: Volumes on several devices aren't supported by "
+        "this tool yet." << std::endl;
+      return 1;
+    }
+    std::uint64_t blocks = state.device.size()/params.block_size;
+
+    Allocator allocator(blocks);
+    allocator.mark(0);
+
+    SecureString passphrase;
+    Pinentry pinentry;
+    pinentry.SETDESC("Enter passphrases for all other partitions on this "
+        "volume. Enter an empty passphrase after last passphrase.");
+    pinentry.SETPROMPT("Passphrase:");
+    while ((passphrase = pinentry.GETPIN()) != "") {
+      Superblock superblock(params, passphrase, blocks);
+      try {
+        superblock.load(state.device);
+        for (auto block : superblock.blocks)
+          allocator.mark(block);
+      } catch(...) {
+        pinentry.SETERROR("No partition found for that passphrase.");
+      }
+    }
+
+    pinentry.SETDESC("Enter passphrase for the partition to reencrypt.");
+    passphrase = pinentry.GETPIN();
+    Superblock superblock(params, passphrase, blocks);
+    try {
+      superblock.load(state.device);
+    } catch(...) {
+      std::cerr << "Error: No partition found for that passphrase." << std::endl;
+      return 1;
+    }
+    for (auto block : superblock.blocks)
+      if (block != 0)
+        allocator.mark(block);
+    if (!superblock.crash_safe() && !state.force) {
+      std::cerr << "Error: The superblock of this partition is rewritten in "
+        "place, so a crash while reencrypting would lose the partition. Use "
+        "--force to reencrypt it anyway." << std::endl;
+      return 1;
+    }
+
+    SecureString derived_key = params.disk_key(passphrase);
+    SecureString key = superblock.disk_key.empty() ? derived_key :
+      superblock.disk_key;
+    std::string cipher = superblock.device_cipher.empty() ?
+      params.device_cipher : superblock.device_cipher;
+    if (superblock.next_key.empty()) {
+      superblock.next_cipher = state.cipher.empty() ? cipher : state.cipher;
+      superblock.next_key = random_key(state.key_size ? state.key_size :
+          params.key_size);
+      superblock.reencrypted = 0;
+    } else {
+      std::cout << "Resuming reencryption to " << superblock.next_cipher
+        << " after " << superblock.reencrypted << " blocks." << std::endl;
+    }
+
+    std::string name = default_name(params, derived_key);
+    if (state.name.empty()) {
+      if (dm_exists(name))
+        state.name = name;
+    } else if (!dm_exists(state.name)) {
+      std::cerr << "Error: " << state.name << " does not exist." << std::endl;
+      return 1;
+    }
+    // A mapping left out of the suspends would keep writing to the old blocks
+    for (const auto& holder : dm_holders(params, state.device,
+          superblock.blocks))
+      if (holder != state.name) {
+        std::cerr << "Error: The partition is open as " << holder
+          << ", which has to be given with --name." << std::endl;
+        return 1;
+      }
+
+    std::size_t offset = superblock.offset;
+    std::size_t size = superblock.blocks.size();
+    std::uint64_t total = 0, done = 0;
+    for (std::size_t entry = offset; entry < size; entry++)
+      if (superblock.blocks[entry] != 0)
+        (entry < offset+superblock.reencrypted ? done : total)++;
+    total += done;
+
+    CopyEngine engine(params.block_size, state.threads, state.bandwidth);
+    for (std::size_t begin = offset+superblock.reencrypted; begin < size; ) {
+      std::vector<std::size_t> entries;
+      std::size_t end = begin;
+      for (; end < size && entries.size() < state.batch; end++)
+        if (superblock.blocks[end] != 0)
+          entries.push_back(end);
+
+      // Every block is read through a mapping of the partition under the old
+      // key and written through one of its new place under the new key, at
+      // the same position, so that the kernel does the crypto.
+      auto destinations = allocator.allocate(entries.size(),
+          superblock.run_length);
+      std::vector<std::uint64_t> old;
+      std::vector<std::pair<std::uint64_t, std::uint64_t>> moves;
+      for (std::size_t i = 0; i < entries.size(); i++) {
+        old.push_back(superblock.blocks[entries[i]]);
+        moves.emplace_back(entries[i]-offset, entries[i]-offset);
+      }
+      // Only the batch is mapped, behind an error target standing in for the
+      // entries before it
+      auto batch_table = [&](const std::string& cipher,
+          const SecureString& key) {
+        std::vector<Target> table;
+        if (begin > offset)
+          table.push_back({0, (begin-offset)*params.block_size/512, "error",
+              ""});
+        auto batch = crypt_table(params, state.device, superblock.blocks,
+            offset, begin, end, superblock.logical_iv, cipher, key);
+        table.insert(table.end(), batch.begin(), batch.end());
+        return table;
+      };
+
+      // An open partition is suspended while its blocks move, so that no
+      // write lands on a block after it was copied.
+      if (!state.name.empty())
+        dm_suspend(state.name);
+      try {
+        if (!entries.empty()) {
+          TemporaryDevice from(name + "-reencrypt-old",
+              batch_table(cipher, key));
+          for (std::size_t i = 0; i < entries.size(); i++)
+            superblock.set(entries[i], destinations[i]);
+          TemporaryDevice to(name + "-reencrypt-new",
+              batch_table(superblock.next_cipher, superblock.next_key));
+          engine.copy(from.device, to.device, moves);
+        }
+        superblock.reencrypted = end-offset;
+        // Only swapped in on resume, after the superblock is stored
+        if (!state.name.empty())
+          dm_reload(state.name, partition_table(params, superblock,
+                state.device, derived_key));
+      } catch(...) {
+        if (!state.name.empty())
+          dm_resume(state.name);
+        throw;
+      }
+      try {
+        superblock.store(state.device);
+      } catch(...) {
+        // Either table may be wrong now, so neither is resumed
+        if (!state.name.empty())
+          std::cerr << "Error: Storing the superblock failed, " << state.name
+            << " is left suspended." << std::endl;
+        throw;
+      }
+      if (!state.name.empty())
+        dm_resume(state.name);
+
+      // The old blocks are only free once the superblock no longer points
+      // to them.
+      for (const auto& block : old)
+        allocator.release(block);
+      done += entries.size();
+      std::cout << "\r" << done << "/" << total << " blocks reencrypted."
+        << std::flush;
+      begin = end;
+    }
+    std::cout << std::endl;
+
+    // Every block is under the new key now, which becomes the only one
+    superblock.disk_key = superblock.next_key;
+    superblock.device_cipher = superblock.next_cipher == params.device_cipher ?
+      "" : superblock.next_cipher;
+    superblock.next_key.clear();
+    superblock.next_cipher.clear();
+    superblock.reencrypted = 0;
+    superblock.store(state.device);
+    return 0;
+  } catch(const std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
@@ -0,0 +1,267 @@
+#include "allocator.h"
+#include "blockdevice.h"
+#include "copy.h"
+#include "header.h"
+#include "mapper.h"
+#include "pinentry.h"
+#include "argp-parsers.h"
+#include <argp.h>
+#include <iostream>
+#include <limits>
+#include <algorithm>
+
+const char* doc = "Move the blocks of an encrypted partition on DEVICE to a "
+  "new layout";
+
+argp_option options[] = {
+  {"name", 'n', "NAME", 0, "NAME is the device the partition is open as "
+    "under /dev/mapper, if not the default one", 0},
+  {"run-length", 'r', "BLOCKS", 0, "Move the partition into runs of BLOCKS "
+    "physically contiguous blocks. Defaults to the run length the partition "
+    "was created with.", 0},
+  {"shuffle", 's', nullptr, 0, "Move every block, even those already laid "
+    "out as asked", 0},
+  {"batch", 'B', "BLOCKS", 0, "Number of blocks to move between superblock "
+    "updates", 0},
+  {"threads", 'j', "N", 0, "Number of copy requests in flight", 0},
+  {"bandwidth", 'l', "MIB", 0, "Copy at most MIB mebibytes per second", 0},
+  {"force", 'f', nullptr, 0, "Move blocks even if the superblock is "
+    "rewritten in place, as on volumes with a single copy of each "
+    "superblock chunk. A crash while moving them then loses the "
+    "partition.", 0},
+  {nullptr, 0, nullptr, 0, nullptr, 0}
+};
+
+struct State {
+  std::string name;
+  std::uint64_t run_length = 0;
+  bool shuffle = false;
+  std::uint64_t batch = 64;
+  unsigned threads = 4;
+  std::uint64_t bandwidth = 0;
+  bool force = false;
+  BlockDevice device;
+};
+
+error_t init_parsers(int key, char* arg, argp_state* state) {
+  State& args = *reinterpret_cast<State*>(state->input);
+  switch (key) {
+    case 'n':
+      args.name = arg;
+      break;
+    case 'r':
+      args.run_length = std::max<std::int64_t>(from_string<std::int64_t>(arg),
+          0);
+      if (args.run_length == 0)
+        argp_failure(state, 1, 0, "Run length must be positive");
+      break;
+    case 's':
+      args.shuffle = true;
+      break;
+    case 'B':
+      args.batch = std::max<std::int64_t>(from_string<std::int64_t>(arg), 0);
+      if (args.batch == 0)
+        argp_failure(state, 1, 0, "Batch size must be positive");
+      break;
+    case 'j':
+      args.threads = std::max<std::int64_t>(from_string<std::int64_t>(arg), 0);
+      if (args.threads == 0)
+        argp_failure(state, 1, 0, "Number of threads must be positive");
+      break;
+    case 'l':
+      args.bandwidth = std::max<std::int64_t>(from_string<std::int64_t>(arg),
+          0);
+      if (args.bandwidth == 0)
+        argp_failure(state, 1, 0, "Bandwidth must be positive");
+      if (args.bandwidth > std::numeric_limits<std::int64_t>::max() >> 20)
+        argp_failure(state, 1, 0, "Bandwidth too large");
+      args.bandwidth <<= 20;
+      break;
+    case 'f':
+      args.force = true;
+      break;
+    case ARGP_KEY_INIT:
+      state->child_inputs[0] = &args.device;
+      break;
+    default:
+      return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[])
+  try {
+    State state;
+    auto parsers = new_subparser({"device", "stats"});
+    argp argp = {options, init_parsers, nullptr, doc, parsers.get(), nullptr,
+      nullptr};
+    argp_parse(&argp, argc, argv, 0, nullptr, &state);
+
+    Params params;
+
+    try {
+      params.load(state.device);
+    } catch(const std::exception& e) {
+      std::cerr << "Error: Header corrupt." << std::endl;
+      return 1;
+    }
+    if (!params.devices.empty()) {
+      std::cerr << "Error: Volumes on several devices aren't supported by "
+        "this tool yet." << std::endl;
+      return 1;
+    }
+    std::uint64_t blocks = state.device.size()/params.block_size;
+
+    Allocator allocator(blocks);
+    allocator.mark(0);
+
+    SecureString passphrase;
+    Pinentry pinentry;
+    pinentry.SETDESC("Enter passphrases for all other partitions on this "
+        "volume. Enter an empty passphrase after last passphrase.");
+    pinentry.SETPROMPT("Passphrase:");
+    while ((passphrase = pinentry.GETPIN()) != "") {
+      Superblock superblock(params, passphrase, blocks);
+      try {
+        superblock.load(state.device);
+        for (auto block : superblock.blocks)
+          allocator.mark(block);
+      } catch(...) {
+        pinentry.SETERROR("No partition found for that passphrase.");
+      }
+    }
+
+    pinentry.SETDESC("Enter passphrase for the partition to relocate.");
+    passphrase = pinentry.GETPIN();
+    Superblock superblock(params, passphrase, blocks);
+    try {
+      superblock.load(state.device);
+    } catch(...) {
+      std::cerr << "Error: No partition found for that passphrase." << std::endl;
+      return 1;
+    }
+    for (auto block : superblock.blocks)
+      if (block != 0)
+        allocator.mark(block);
+    if (!superblock.crash_safe() && !state.force) {
+      std::cerr << "Error: The superblock of this partition is rewritten in "
+        "place, so a crash while moving blocks would lose the partition. Use "
+        "--force to move them anyway." << std::endl;
+      return 1;
+    }
+
+    std::uint64_t run = state.run_length ? state.run_length :
+      superblock.run_length;
+
+    // Entries are moved in groups of run entries, each of which should end
+    // up in one aligned run of blocks. Whole groups go first in every batch
+    // so that partially mapped ones don't shift the runs after them.
+    std::vector<std::vector<std::size_t>> full, partial;
+    for (std::size_t group = superblock.offset;
+        group < superblock.blocks.size(); group += run) {
+      std::size_t end = std::min<std::size_t>(group+run,
+          superblock.blocks.size());
+      std::vector<std::size_t> entries;
+      bool in_place = superblock.blocks[group]%run == 0;
+      for (std::size_t entry = group; entry < end; entry++) {
+        if (superblock.blocks[entry] == 0)
+          in_place = false;
+        else
+          entries.push_back(entry);
+        if (entry != group &&
+            superblock.blocks[entry] != superblock.blocks[entry-1]+1)
+          in_place = false;
+      }
+      if (entries.empty() || (in_place && !state.shuffle))
+        continue;
+      (entries.size() == run ? full : partial).push_back(entries);
+    }
+    full.insert(full.end(), partial.begin(), partial.end());
+
+    std::uint64_t total = 0;
+    for (const auto& entries : full)
+      total += entries.size();
+    std::cout << total << " blocks to move." << std::endl;
+    if (total == 0)
+      return 0;
+
+    SecureString key = params.disk_key(passphrase);
+    if (state.name.empty()) {
+      std::string name = default_name(params, key);
+      if (dm_exists(name))
+        state.name = name;
+    } else if (!dm_exists(state.name)) {
+      std::cerr << "Error: " << state.name << " does not exist." << std::endl;
+      return 1;
+    }
+    // A mapping left out of the suspends would keep writing to the old blocks
+    for (const auto& holder : dm_holders(params, state.device,
+          superblock.blocks))
+      if (holder != state.name) {
+        std::cerr << "Error: The partition is open as " << holder
+          << ", which has to be given with --name." << std::endl;
+        return 1;
+      }
+
+    CopyEngine engine(params.block_size, state.threads, state.bandwidth);
+    superblock.run_length = run;
+    std::uint64_t moved = 0;
+    for (auto group = full.begin(); group != full.end(); ) {
+      std::vector<std::size_t> entries;
+      while (group != full.end() && entries.size() < state.batch) {
+        entries.insert(entries.end(), group->begin(), group->end());
+        ++group;
+      }
+      std::vector<std::pair<std::uint64_t, std::uint64_t>> moves;
+      auto destinations = allocator.allocate(entries.size(), run);
+      for (std::size_t i = 0; i < entries.size(); i++)
+        moves.emplace_back(superblock.blocks[entries[i]], destinations[i]);
+
+      // An open partition is suspended while its blocks move, so that no
+      // write lands on a block after it was copied.
+      if (!state.name.empty())
+        dm_suspend(state.name);
+      try {
+        // Bypassing the page cache, which may hold blocks from before the
+        // partition last wrote them
+        state.device.direct(true);
+        engine.copy(state.device, state.device, moves);
+        state.device.direct(false);
+        for (std::size_t i = 0; i < entries.size(); i++)
+          superblock.set(entries[i], destinations[i]);
+        // Loaded now but only swapped in on resume, so that until the
+        // superblock is stored the old table can still be resumed
+        if (!state.name.empty())
+          dm_reload(state.name, partition_table(params, superblock,
+                state.device, key));
+      } catch(...) {
+        if (!state.name.empty())
+          dm_resume(state.name);
+        throw;
+      }
+      try {
+        superblock.store(state.device);
+      } catch(...) {
+        // Either table may be wrong now, so neither is resumed
+        if (!state.name.empty())
+          std::cerr << "Error: Storing the superblock failed, " << state.name
+            << " is left suspended." << std::endl;
+        throw;
+      }
+      if (!state.name.empty())
+        dm_resume(state.name);
+
+      // The old blocks are only free once the superblock no longer points
+      // to them.
+      for (const auto& move : moves)
+        allocator.release(move.first);
+      moved += moves.size();
+      std::cout << "\r" << moved << "/" << total << " blocks moved."
+        << std::flush;
+    }
+    std::cout << std::endl;
+    return 0;
+  } catch(const std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
@@ -0,0 +1,348 @@
+#include "allocator.h"
+#include "blockdevice.h"
+#include "copy.h"
+#include "header.h"
+#include "mapper.h"
+#include "pinentry.h"
+#include "argp-parsers.h"
+#include <argp.h>
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <thread>
+
+const char* doc = "Move the most used blocks of an open partition on a tiered "
+  "volume to its fast devices, and the least used ones off them\vAccesses "
+  "are counted with device-mapper statistics while the partition is in use. "
+  "A volume on several devices takes all of them, in any order.";
+
+argp_option options[] = {
+  {"name", 'n', "NAME", 0, "NAME is the device the partition is open as "
+    "under /dev/mapper, if not the default one", 0},
+  {"interval", 'i', "SECONDS", 0, "Count accesses for SECONDS before moving "
+    "blocks. Defaults to a minute.", 0},
+  {"max-blocks", 'm', "BLOCKS", 0, "Move at most BLOCKS blocks", 0},
+  {"batch", 'B', "BLOCKS", 0, "Number of blocks to move between superblock "
+    "updates", 0},
+  {"threads", 'j', "N", 0, "Number of copy requests in flight", 0},
+  {"bandwidth", 'l', "MIB", 0, "Copy at most MIB mebibytes per second", 0},
+  {"force", 'f', nullptr, 0, "Move blocks even if the superblock is "
+    "rewritten in place, as on volumes with a single copy of each "
+    "superblock chunk. A crash while moving them then loses the "
+    "partition.", 0},
+  {nullptr, 0, nullptr, 0, nullptr, 0}
+};
+
+struct State {
+  std::string name;
+  unsigned interval = 60;
+  std::uint64_t max_blocks = std::numeric_limits<std::uint64_t>::max();
+  std::uint64_t batch = 64;
+  unsigned threads = 4;
+  std::uint64_t bandwidth = 0;
+  bool force = false;
+  std::vector<BlockDevice> devices;
+};
+
+error_t init_parsers(int key, char* arg, argp_state* state) {
+  State& args = *reinterpret_cast<State*>(state->input);
+  switch (key) {
+    case 'n':
+      args.name = arg;
+      break;
+    case 'i':
+      args.interval = std::max<std::int64_t>(from_string<std::int64_t>(arg),
+          0);
+      if (args.interval == 0)
+        argp_failure(state, 1, 0, "Interval must be positive");
+      break;
+    case 'm':
+      args.max_blocks = std::max<std::int64_t>(from_string<std::int64_t>(arg),
+          0);
+      if (args.max_blocks == 0)
+        argp_failure(state, 1, 0, "Number of blocks must be positive");
+      break;
+    case 'B':
+      args.batch = std::max<std::int64_t>(from_string<std::int64_t>(arg), 0);
+      if (args.batch == 0)
+        argp_failure(state, 1, 0, "Batch size must be positive");
+      break;
+    case 'j':
+      args.threads = std::max<std::int64_t>(from_string<std::int64_t>(arg), 0);
+      if (args.threads == 0)
+        argp_failure(state, 1, 0, "Number of threads must be positive");
+      break;
+    case 'l':
+      args.bandwidth = std::max<std::int64_t>(from_string<std::int64_t>(arg),
+          0);
+      if (args.bandwidth == 0)
+        argp_failure(state, 1, 0, "Bandwidth must be positive");
+      if (args.bandwidth > std::numeric_limits<std::int64_t>::max() >> 20)
+        argp_failure(state, 1, 0, "Bandwidth too large");
+      args.bandwidth <<= 20;
+      break;
+    case 'f':
+      args.force = true;
+      break;
+    case ARGP_KEY_INIT:
+      state->child_inputs[0] = &args.devices;
+      break;
+    default:
+      return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
+
+// Reads and writes of each of the first blocks blocks of the partition open
+// as name over seconds, counted in a dm statistics region with one area per
+// block
+std::vector<std::uint64_t> access_counts(const std::string& name,
+    std::uint64_t block_size, std::size_t blocks, unsigned seconds) {
+  const std::size_t LINES = 4096;
+  std::vector<std::uint64_t> counts(blocks, 0);
+  std::string region = dm_message(name, "@stats_create - " +
+      std::to_string(block_size/512));
+  try {
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    for (std::size_t line = 0; line < blocks; line += LINES) {
+      std::istringstream reply(dm_message(name, "@stats_print " + region +
+            " " + std::to_string(line) + " " + std::to_string(LINES)));
+      // start+length, then reads, merged reads, sectors read, milliseconds
+      // reading, writes and more counters
+      std::string area;
+      while (std::getline(reply, area)) {
+        std::istringstream fields(area);
+        std::uint64_t start, length, reads, writes, skip;
+        char plus;
+        if (!(fields >> start >> plus >> length >> reads >> skip >> skip >>
+              skip >> writes))
+          throw std::runtime_error("unexpected dm statistics: " + area);
+        std::size_t block = start/(block_size/512);
+        if (block < blocks)
+          counts[block] = reads+writes;
+      }
+    }
+  } catch(...) {
+    dm_message(name, "@stats_delete " + region);
+    throw;
+  }
+  dm_message(name, "@stats_delete " + region);
+  return counts;
+}
+
+// Copies blocks between the devices of a volume, numbered as bounds says
+void copy(CopyEngine& engine, std::vector<BlockDevice>& devices,
+    const std::vector<std::uint64_t>& bounds,
+    const std::vector<std::pair<std::uint64_t, std::uint64_t>>& moves) {
+  auto device_of = [&](std::uint64_t block) {
+    return std::upper_bound(bounds.begin()+1, bounds.end()-1, block)-
+      bounds.begin()-1;
+  };
+  std::map<std::pair<std::size_t, std::size_t>,
+    std::vector<std::pair<std::uint64_t, std::uint64_t>>> by_device;
+  for (const auto& move : moves) {
+    std::size_t from = device_of(move.first), to = device_of(move.second);
+    by_device[{from, to}].emplace_back(move.first-bounds[from],
+        move.second-bounds[to]);
+  }
+  // Bypassing the page cache, which may hold blocks from before the
+  // partition last wrote them
+  for (auto& device : devices)
+    device.direct(true);
+  for (const auto& group : by_device)
+    engine.copy(devices[group.first.first], devices[group.first.second],
+        group.second);
+  for (auto& device : devices)
+    device.direct(false);
+}
+
+int main(int argc, char *argv[])
+  try {
+    State state;
+    auto parsers = new_subparser({"devices", "stats"});
+    argp argp = {options, init_parsers, nullptr, doc, parsers.get(), nullptr,
+      nullptr};
+    argp_parse(&argp, argc, argv, 0, nullptr, &state);
+
+    Params params;
+
+    try {
+      params.load(state.devices);
+    } catch(const std::exception& e) {
+      if (state.devices.size() > 1)
+        std::cerr << "Error: " << e.what() << "." << std::endl;
+      else
+        std::cerr << "Error: Header corrupt." << std::endl;
+      return 1;
+    }
+    if (params.fast_devices == 0) {
+      std::cerr << "Error: The volume has no fast devices." << std::endl;
+      return 1;
+    }
+    BlockDevice& device = state.devices.front();
+    auto bounds = params.bounds(device.size()/params.block_size);
+    auto fast_tier = params.tier_bounds(bounds[1], true);
+    auto slow_tier = params.tier_bounds(bounds[1], false);
+
+    Allocator allocator(bounds.back());
+    for (std::size_t i = 0; i+1 < bounds.size(); i++)
+      allocator.mark(bounds[i]);
+
+    SecureString passphrase;
+    Pinentry pinentry;
+    pinentry.SETDESC("Enter passphrases for all other partitions on this "
+        "volume. Enter an empty passphrase after last passphrase.");
+    pinentry.SETPROMPT("Passphrase:");
+    while ((passphrase = pinentry.GETPIN()) != "") {
+      Superblock superblock(params, passphrase, bounds[1]);
+      try {
+        superblock.load(device);
+        for (auto block : superblock.blocks)
+          allocator.mark(block);
+      } catch(...) {
+        pinentry.SETERROR("No partition found for that passphrase.");
+      }
+    }
+
+    pinentry.SETDESC("Enter passphrase for the partition to retier.");
+    passphrase = pinentry.GETPIN();
+    Superblock superblock(params, passphrase, bounds[1]);
+    try {
+      superblock.load(device);
+    } catch(...) {
+      std::cerr << "Error: No partition found for that passphrase." << std::endl;
+      return 1;
+    }
+    for (auto block : superblock.blocks)
+      if (block != 0)
+        allocator.mark(block);
+    if (!superblock.crash_safe() && !state.force) {
+      std::cerr << "Error: The superblock of this partition is rewritten in "
+        "place, so a crash while moving blocks would lose the partition. Use "
+        "--force to move them anyway." << std::endl;
+      return 1;
+    }
+
+    SecureString key = params.disk_key(passphrase);
+    if (state.name.empty())
+      state.name = default_name(params, key);
+    if (!dm_exists(state.name)) {
+      std::cerr << "Error: " << state.name << " does not exist. The "
+        "partition has to be open to count accesses." << std::endl;
+      return 1;
+    }
+
+    std::cout << "Counting accesses for " << state.interval << " seconds."
+      << std::endl;
+    std::size_t offset = superblock.offset;
+    auto counts = access_counts(state.name, params.block_size,
+        superblock.blocks.size()-offset, state.interval);
+
+    // Blocks used on the slow tier, most accessed first, and blocks on the
+    // fast tier, least accessed first
+    std::vector<std::size_t> hot, cold;
+    for (std::size_t entry = offset; entry < superblock.blocks.size();
+        entry++) {
+      std::uint64_t block = superblock.blocks[entry];
+      if (block == 0)
+        continue;
+      if (block < fast_tier.back())
+        cold.push_back(entry);
+      else if (counts[entry-offset] > 0)
+        hot.push_back(entry);
+    }
+    std::stable_sort(hot.begin(), hot.end(), [&](std::size_t a, std::size_t b) {
+      return counts[a-offset] > counts[b-offset];
+    });
+    std::stable_sort(cold.begin(), cold.end(),
+        [&](std::size_t a, std::size_t b) {
+      return counts[a-offset] < counts[b-offset];
+    });
+
+    std::uint64_t fast_free = 0;
+    for (std::uint64_t block = fast_tier.front(); block < fast_tier.back();
+        block++)
+      if (!allocator.allocated(block))
+        fast_free++;
+
+    // Hot blocks take free room on the fast tier first, then swap places
+    // with colder ones
+    std::vector<std::size_t> promote, demote;
+    auto coldest = cold.begin();
+    for (auto entry : hot) {
+      if (fast_free > 0 && promote.size()+demote.size() < state.max_blocks) {
+        fast_free--;
+        promote.push_back(entry);
+        continue;
+      }
+      if (coldest == cold.end() ||
+          counts[*coldest-offset] >= counts[entry-offset] ||
+          promote.size()+demote.size()+2 > state.max_blocks)
+        break;
+      demote.push_back(*coldest++);
+      promote.push_back(entry);
+    }
+
+    std::uint64_t total = promote.size()+demote.size();
+    std::cout << promote.size() << " blocks to move to fast devices, "
+      << demote.size() << " off them." << std::endl;
+    if (total == 0)
+      return 0;
+
+    CopyEngine engine(params.block_size, state.threads, state.bandwidth);
+    std::uint64_t moved = 0;
+    // Demotions go first to make room for promotions
+    auto move = [&](const std::vector<std::size_t>& entries,
+        const std::vector<std::uint64_t>& tier) {
+      for (std::size_t first = 0; first < entries.size();
+          first += state.batch) {
+        std::vector<std::size_t> batch(entries.begin()+first,
+            entries.begin()+std::min<std::size_t>(first+state.batch,
+              entries.size()));
+        std::vector<std::pair<std::uint64_t, std::uint64_t>> moves;
+        auto destinations = allocator.allocate(batch.size(), 1, tier);
+        for (std::size_t i = 0; i < batch.size(); i++)
+          moves.emplace_back(superblock.blocks[batch[i]], destinations[i]);
+
+        // The partition is suspended while its blocks move, so that no
+        // write lands on a block after it was copied.
+        dm_suspend(state.name);
+        try {
+          copy(engine, state.devices, bounds, moves);
+          for (std::size_t i = 0; i < batch.size(); i++)
+            superblock.set(batch[i], destinations[i]);
+          // Only swapped in on resume, after the superblock is stored
+          dm_reload(state.name, partition_table(params, superblock,
+                state.devices, key));
+        } catch(...) {
+          dm_resume(state.name);
+          throw;
+        }
+        try {
+          superblock.store(device);
+        } catch(...) {
+          // Either table may be wrong now, so neither is resumed
+          std::cerr << "Error: Storing the superblock failed, " << state.name
+            << " is left suspended." << std::endl;
+          throw;
+        }
+        dm_resume(state.name);
+
+        for (const auto& move : moves)
+          allocator.release(move.first);
+        moved += moves.size();
+        std::cout << "\r" << moved << "/" << total << " blocks moved."
+          << std::flush;
+      }
+    };
+    move(demote, slow_tier);
+    move(promote, fast_tier);
+    std::cout << std::endl;
+    return 0;
+  } catch(const std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
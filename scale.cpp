@@ -0,0 +1,237 @@
+#include "allocator.h"
+#include "blockdevice.h"
+#include "header.h"
+#include "layout.h"
+#include "mapper.h"
+#include <argp.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+
+const char* doc = "Run format, create and open against a sparse volume of "
+  "any size, and report the time and peak memory of every phase\vThe volume "
+  "is an anonymous memory file unless --image is given, and only what is "
+  "written takes space. Key derivation is reduced to --iters iterations. "
+  "Every phase is printed as one line of JSON. Sizes take K, M, G, T and P "
+  "suffixes, and lists are separated by commas.";
+
+argp_option options[] = {
+  {"size", 's', "BYTES", 0, "Size of the volume (default 16T)", 0},
+  {"block-size", 'b', "LIST", 0, "Block sizes to sweep (default 1M,4M,16M)",
+    0},
+  {"partitions", 'p', "LIST", 0, "Numbers of partitions to sweep (default "
+    "1,4)", 0},
+  {"iters", 'i', "N", 0, "PBKDF2 iterations (default 1)", 0},
+  {"image", 'f', "FILE", 0, "Use a sparse file at FILE for the volume", 0},
+  {nullptr, 0, nullptr, 0, nullptr, 0}
+};
+
+std::vector<std::uint64_t> parse_list(const std::string& str) {
+  std::vector<std::uint64_t> ret;
+  std::stringstream ss(str);
+  std::string item;
+  while (std::getline(ss, item, ','))
+    ret.push_back(parse_size(item));
+  return ret;
+}
+
+struct State {
+  std::uint64_t size = parse_size("16T");
+  std::vector<std::uint64_t> block_sizes = parse_list("1M,4M,16M");
+  std::vector<std::uint64_t> partitions = {1, 4};
+  std::size_t iters = 1;
+  std::string image;
+};
+
+error_t parse(int key, char* arg, argp_state* state) {
+  State& args = *reinterpret_cast<State*>(state->input);
+  switch (key) {
+    case 's':
+      try {
+        args.size = parse_size(arg);
+      } catch(const std::exception& e) {
+        argp_failure(state, 1, 0, e.what());
+      }
+      break;
+    case 'b':
+      try {
+        args.block_sizes = parse_list(arg);
+      } catch(const std::exception& e) {
+        argp_failure(state, 1, 0, e.what());
+      }
+      for (auto size : args.block_sizes)
+        if (size == 0 || size % 512 != 0)
+          argp_failure(state, 1, 0, "Block size must be a multiple of 512 "
+              "bytes");
+      break;
+    case 'p':
+      try {
+        args.partitions = parse_list(arg);
+      } catch(const std::exception& e) {
+        argp_failure(state, 1, 0, e.what());
+      }
+      break;
+    case 'i':
+      args.iters = std::max<std::int64_t>(from_string<std::int64_t>(arg), 1);
+      break;
+    case 'f':
+      args.image = arg;
+      break;
+    default:
+      return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
+
+// Peak RSS since the last reset, in KiB
+std::uint64_t peak_rss() {
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line))
+    if (line.compare(0, 6, "VmHWM:") == 0)
+      return from_string<std::uint64_t>(line.substr(6));
+  return 0;
+}
+
+void reset_peak_rss() {
+  std::ofstream("/proc/self/clear_refs") << "5";
+}
+
+// Sums time and peak memory of one phase over all partitions
+struct Phase {
+  std::string name;
+  double seconds = 0;
+  std::uint64_t peak_rss_kb = 0;
+  std::map<std::string, std::uint64_t> counts;
+
+  explicit Phase(const std::string& name) : name(name) {}
+
+  void run(const std::function<void()>& f) {
+    reset_peak_rss();
+    auto start = std::chrono::steady_clock::now();
+    f();
+    seconds += std::chrono::duration<double>(
+        std::chrono::steady_clock::now()-start).count();
+    peak_rss_kb = std::max(peak_rss_kb, peak_rss());
+  }
+};
+
+void report(const std::string& config, const Phase& phase) {
+  std::cout << "{" << config << ",\"phase\":\"" << phase.name
+    << "\",\"seconds\":" << phase.seconds << ",\"peak_rss_kb\":"
+    << phase.peak_rss_kb;
+  for (const auto& count : phase.counts)
+    std::cout << ",\"" << count.first << "\":" << count.second;
+  std::cout << "}" << std::endl;
+}
+
+BlockDevice volume(const State& state) {
+  if (state.image.empty())
+    return BlockDevice::memory(state.size);
+  int fd = ::open(state.image.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1 || ftruncate(fd, state.size) == -1 || close(fd) == -1)
+    throw std::system_error(errno, std::system_category(), state.image);
+  return BlockDevice(state.image);
+}
+
+void sweep(const State& state, std::uint64_t block_size,
+    std::uint64_t partitions) {
+  std::stringstream config;
+  config << "\"size\":" << state.size << ",\"block_size\":" << block_size
+    << ",\"partitions\":" << partitions;
+
+  BlockDevice device = volume(state);
+  Params params;
+  params.block_size = block_size;
+  params.chunk_size = std::min<std::uint64_t>(64 << 10, block_size);
+  params.iters = state.iters;
+  params.key_size = 32;
+  params.hash = "SHA256";
+  params.device_cipher = "aes-xts-plain64";
+  params.superblock_cipher = "AES256";
+  params.superblock_mode = "GCM";
+  params.salt = nonce(16);
+  std::uint64_t blocks = device.size()/block_size;
+  auto bounds = params.bounds(blocks);
+
+  Phase format("format");
+  format.run([&]() { params.store(device); });
+  report(config.str(), format);
+
+  // Every partition gets an equal share of the volume, laid out the way
+  // create does it.
+  Phase unlock("unlock"), allocate("allocate"), store("store");
+  Allocator allocator(blocks);
+  allocator.mark(0);
+  std::vector<SecureString> passphrases;
+  for (std::uint64_t i = 0; i < partitions; i++) {
+    std::unique_ptr<Superblock> superblock;
+    // Passphrases whose superblock locations are all used are rejected by
+    // create too
+    for (std::uint64_t attempt = 0; ; attempt++) {
+      std::string name = "partition " + std::to_string(i) + "/" +
+        std::to_string(attempt);
+      SecureString passphrase(name.begin(), name.end());
+      unlock.run([&]() {
+        superblock.reset(new Superblock(params, passphrase, blocks));
+      });
+      if (claim_location(allocator, *superblock)) {
+        passphrases.push_back(passphrase);
+        break;
+      }
+      unlock.counts["rejected_passphrases"]++;
+    }
+
+    allocate.run([&]() {
+      // Counting the root, which is claimed already
+      std::uint64_t share = (allocator.free()+1)/(partitions-i);
+      lay_out(allocator, bounds, *superblock, share,
+          Superblock::partition_size(params, share), 1);
+    });
+    allocate.counts["entries"] += superblock->blocks.size();
+    allocate.counts["superblock_blocks"] += superblock->offset;
+
+    store.run([&]() { superblock->store(device); });
+  }
+  report(config.str(), unlock);
+  report(config.str(), allocate);
+  report(config.str(), store);
+
+  Phase load("load"), table("table");
+  for (const auto& passphrase : passphrases) {
+    Superblock superblock(params, passphrase, blocks);
+    load.run([&]() { superblock.load(device); });
+    table.run([&]() {
+      auto targets = partition_table(params, superblock, device,
+          params.disk_key(passphrase));
+      table.counts["targets"] += targets.size();
+      table.counts["table_bytes"] += table_size(targets);
+    });
+  }
+  report(config.str(), load);
+  report(config.str(), table);
+}
+
+int main(int argc, char *argv[])
+  try {
+    State state;
+    argp argp = {options, parse, nullptr, doc, nullptr, nullptr, nullptr};
+    argp_parse(&argp, argc, argv, 0, nullptr, &state);
+
+    for (auto block_size : state.block_sizes)
+      for (auto partitions : state.partitions)
+        sweep(state, block_size, partitions);
+    if (!state.image.empty())
+      unlink(state.image.c_str());
+    return 0;
+  } catch(const std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
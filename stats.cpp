@@ -0,0 +1,157 @@
+#include "stats.h"
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <sys/resource.h>
+#include <unistd.h>
+
+namespace {
+
+struct TimerTotal {
+  std::uint64_t count = 0, wall_ns = 0, cpu_ns = 0;
+};
+
+std::uint64_t nanoseconds(const timespec& t) {
+  return std::uint64_t(t.tv_sec)*1000000000+t.tv_nsec;
+}
+
+timespec now(clockid_t clock) {
+  timespec t;
+  clock_gettime(clock, &t);
+  return t;
+}
+
+std::string quote(const std::string& str) {
+  std::string ret = "\"";
+  for (char c : str) {
+    if (c == '"' || c == '\\')
+      ret += '\\';
+    ret += c;
+  }
+  return ret + "\"";
+}
+
+class Registry {
+ public:
+  Registry() : _start(now(CLOCK_MONOTONIC)), _enabled(false) {
+    if (const char* file = std::getenv("DDE_STATS"))
+      enable(file);
+  }
+
+  ~Registry() {
+    if (_enabled)
+      write();
+  }
+
+  void enable(const std::string& file) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _file = file;
+    _enabled = true;
+  }
+
+  bool enabled() const {
+    return _enabled.load(std::memory_order_relaxed);
+  }
+
+  void count(const char* name, std::uint64_t n) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _counters[name] += n;
+  }
+
+  void time(const char* name, std::uint64_t wall_ns, std::uint64_t cpu_ns) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    TimerTotal& total = _timers[name];
+    total.count++;
+    total.wall_ns += wall_ns;
+    total.cpu_ns += cpu_ns;
+  }
+
+ private:
+  void write() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    std::stringstream ss;
+    ss << "{\"tool\":" << quote(program_invocation_short_name)
+      << ",\"pid\":" << getpid()
+      << ",\"time\":" << std::time(nullptr)
+      << ",\"wall_ns\":"
+      << nanoseconds(now(CLOCK_MONOTONIC))-nanoseconds(_start)
+      << ",\"cpu_ns\":" << nanoseconds(now(CLOCK_PROCESS_CPUTIME_ID))
+      << ",\"max_rss_kb\":" << usage.ru_maxrss << ",\"timers\":{";
+    const char* separator = "";
+    for (const auto& timer : _timers) {
+      ss << separator << quote(timer.first) << ":{\"count\":"
+        << timer.second.count << ",\"wall_ns\":" << timer.second.wall_ns
+        << ",\"cpu_ns\":" << timer.second.cpu_ns << "}";
+      separator = ",";
+    }
+    ss << "},\"counters\":{";
+    separator = "";
+    for (const auto& counter : _counters) {
+      ss << separator << quote(counter.first) << ":" << counter.second;
+      separator = ",";
+    }
+    ss << "}}";
+
+    if (_file == "-") {
+      std::cerr << ss.str() << std::endl;
+    } else {
+      std::ofstream out(_file, std::ios::app);
+      out << ss.str() << std::endl;
+    }
+  }
+
+  timespec _start;
+  std::atomic<bool> _enabled;
+  std::string _file;
+  std::mutex _mutex;
+  std::map<std::string, std::uint64_t> _counters;
+  std::map<std::string, TimerTotal> _timers;
+};
+
+Registry& registry() {
+  static Registry registry;
+  return registry;
+}
+
+// Start the clock with the program rather than at the first event
+struct Init {
+  Init() {
+    registry();
+  }
+} init;
+
+}  // namespace
+
+void stats::enable(const std::string& file) {
+  registry().enable(file);
+}
+
+bool stats::enabled() {
+  return registry().enabled();
+}
+
+void stats::count(const char* name, std::uint64_t n) {
+  if (registry().enabled())
+    registry().count(name, n);
+}
+
+stats::Timer::Timer(const char* name)
+  : _name(name), _enabled(stats::enabled()) {
+  if (_enabled) {
+    _wall = now(CLOCK_MONOTONIC);
+    _cpu = now(CLOCK_THREAD_CPUTIME_ID);
+  }
+}
+
+stats::Timer::~Timer() {
+  if (_enabled)
+    registry().time(_name,
+        nanoseconds(now(CLOCK_MONOTONIC))-nanoseconds(_wall),
+        nanoseconds(now(CLOCK_THREAD_CPUTIME_ID))-nanoseconds(_cpu));
+}
@@ -0,0 +1,33 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <cstdint>
+#include <ctime>
+#include <string>
+
+// Lightweight instrumentation: named counters and scoped timers, summed over
+// the run and written out as one JSON record at exit. Recording is off unless
+// enabled with --stats or the DDE_STATS environment variable, both naming
+// the file to append the record to, or - for standard error.
+namespace stats {
+  void enable(const std::string& file);
+  bool enabled();
+
+  void count(const char* name, std::uint64_t n = 1);
+
+  // Adds the wall and CPU time of its lifetime to name
+  class Timer {
+   public:
+    explicit Timer(const char* name);
+    Timer(const Timer&) = delete;
+    ~Timer();
+    Timer& operator=(const Timer&) = delete;
+
+   private:
+    const char* _name;
+    bool _enabled;
+    timespec _wall, _cpu;
+  };
+}
+
+#endif  // STATS_H_
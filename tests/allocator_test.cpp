@@ -0,0 +1,188 @@
+#include "../allocator.h"
+#include "test.h"
+#include <algorithm>
+#include <cmath>
+#include <set>
+
+// Chi-squared statistic of counts against a uniform distribution
+static double chi_squared(const std::vector<std::uint64_t>& counts) {
+  double total = 0;
+  for (auto count : counts)
+    total += count;
+  double expected = total/counts.size(), ret = 0;
+  for (auto count : counts)
+    ret += (count-expected)*(count-expected)/expected;
+  return ret;
+}
+
+// Whether a chi-squared statistic with df degrees of freedom is within six
+// standard deviations of its mean, which a uniform sample all but always is
+static bool uniform(double statistic, std::size_t df) {
+  return statistic < df+6*std::sqrt(2.0*df);
+}
+
+// Every block is free before and allocated after, and none comes twice
+static bool fresh(const std::vector<std::uint64_t>& blocks,
+    const std::vector<bool>& was_allocated, const Allocator& allocator) {
+  std::set<std::uint64_t> seen;
+  for (auto block : blocks)
+    if (block >= was_allocated.size() || was_allocated[block] ||
+        !allocator.allocated(block) || !seen.insert(block).second)
+      return false;
+  return true;
+}
+
+static std::vector<bool> snapshot(const Allocator& allocator) {
+  std::vector<bool> ret;
+  for (std::uint64_t block = 0; block < allocator.blocks(); block++)
+    ret.push_back(allocator.allocated(block));
+  return ret;
+}
+
+static void test_bitmap() {
+  RandomStream random;
+  for (std::uint64_t size : {1, 63, 64, 65, 1000, 4097}) {
+    Bitmap a(size), b(size);
+    std::vector<bool> x(size), y(size);
+    for (std::uint64_t i = 0; i < size; i++) {
+      if (random.uniform(3) == 0) {
+        a.set(i);
+        x[i] = true;
+      }
+      if (random.uniform(2) == 0) {
+        b.set(i);
+        y[i] = true;
+      }
+    }
+    CHECK(a.count() == std::uint64_t(std::count(x.begin(), x.end(), true)));
+
+    std::uint64_t k = 0, common = 0;
+    for (std::uint64_t i = 0; i < size; i++) {
+      auto next = std::find(x.begin()+i, x.end(), false)-x.begin();
+      CHECK(a.next_clear(i) == std::uint64_t(next));
+      if (!x[i])
+        CHECK(a.select_clear(k++) == i);
+      common += x[i] && y[i];
+    }
+    CHECK_THROWS(a.select_clear(k), std::out_of_range);
+    CHECK(a.count_common(b) == common);
+
+    Bitmap both = a, either = a;
+    both &= b;
+    either |= b;
+    for (std::uint64_t i = 0; i < size; i++) {
+      CHECK(both.test(i) == (x[i] && y[i]));
+      CHECK(either.test(i) == (x[i] || y[i]));
+    }
+    CHECK(both.count() == common);
+  }
+}
+
+// Blocks are taken uniformly from the free ones, in random order, both when
+// sampling few of them and many
+static void test_distribution() {
+  const std::uint64_t blocks = 1000;
+  for (std::uint64_t n : {10, 500}) {
+    std::vector<std::uint64_t> counts(blocks, 0), first(blocks, 0);
+    std::uint64_t trials = 200000/n;
+    for (std::uint64_t trial = 0; trial < trials; trial++) {
+      Allocator allocator(blocks);
+      for (std::uint64_t block = 0; block < blocks; block += 10)
+        allocator.mark(block);
+      auto before = snapshot(allocator);
+      auto allocated = allocator.allocate(n);
+      CHECK(allocated.size() == n);
+      CHECK(fresh(allocated, before, allocator));
+      CHECK(allocator.free() == blocks-blocks/10-n);
+      for (auto block : allocated)
+        counts[block]++;
+      first[allocated.front()]++;
+    }
+    std::vector<std::uint64_t> free_counts, free_first;
+    for (std::uint64_t block = 0; block < blocks; block++)
+      if (block%10 != 0) {
+        free_counts.push_back(counts[block]);
+        free_first.push_back(first[block]);
+      }
+    CHECK(uniform(chi_squared(free_counts), free_counts.size()-1));
+    if (n == 10)
+      CHECK(uniform(chi_squared(free_first), free_first.size()-1));
+  }
+
+  Allocator allocator(100);
+  allocator.allocate(90);
+  CHECK_THROWS(allocator.allocate(11), std::out_of_range);
+  CHECK(allocator.allocate(10).size() == 10);
+  CHECK(allocator.free() == 0);
+}
+
+// Runs are aligned and contiguous while whole ones are free, and the rest
+// goes block by block
+static void test_runs() {
+  Allocator allocator(1024);
+  allocator.mark(5);
+  auto before = snapshot(allocator);
+  auto allocated = allocator.allocate(64*8, 8);
+  CHECK(allocated.size() == 64*8);
+  CHECK(fresh(allocated, before, allocator));
+  for (std::size_t i = 0; i < allocated.size(); i += 8) {
+    CHECK(allocated[i]%8 == 0);
+    for (std::size_t j = 1; j < 8; j++)
+      CHECK(allocated[i+j] == allocated[i]+j);
+  }
+
+  // Every other block taken leaves no whole run
+  Allocator fragmented(1024);
+  for (std::uint64_t block = 0; block < 1024; block += 2)
+    fragmented.mark(block);
+  before = snapshot(fragmented);
+  allocated = fragmented.allocate(300, 4);
+  CHECK(allocated.size() == 300);
+  CHECK(fresh(allocated, before, fragmented));
+}
+
+// Allocations stay within the bounds, dealing runs out to each range in
+// turn and skipping full ones
+static void test_bounds() {
+  Allocator allocator(400);
+  std::vector<std::uint64_t> bounds = {100, 200, 300};
+  auto before = snapshot(allocator);
+  auto allocated = allocator.allocate(80, 4, bounds);
+  CHECK(allocated.size() == 80);
+  CHECK(fresh(allocated, before, allocator));
+  std::uint64_t low = 0, high = 0;
+  for (auto block : allocated) {
+    CHECK(block >= 100 && block < 300);
+    (block < 200 ? low : high)++;
+  }
+  CHECK(low == 40 && high == 40);
+  for (std::size_t i = 0; i < allocated.size(); i += 4)
+    CHECK((allocated[i] < 200) == (i/4%2 == 0));
+
+  // With 10 blocks left below 200 and 60 above, the range below fills up
+  for (std::uint64_t block = 100; block < 200; block++)
+    allocator.mark(block);
+  for (std::uint64_t block = 100; block < 110; block++)
+    allocator.release(block);
+  before = snapshot(allocator);
+  allocated = allocator.allocate(70, 1, bounds);
+  CHECK(fresh(allocated, before, allocator));
+  low = 0;
+  for (auto block : allocated)
+    low += block < 200;
+  CHECK(low == 10);
+  CHECK_THROWS(allocator.allocate(1, 1, bounds), std::out_of_range);
+  CHECK_THROWS(allocator.allocate(1, 1, {0, 401}), std::out_of_range);
+}
+
+int main()
+  try {
+    test_bitmap();
+    test_distribution();
+    test_runs();
+    test_bounds();
+    return test::result();
+  } catch(const std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
@@ -0,0 +1,358 @@
+#include "../header.h"
+#include "../PBKDF2.h"
+#include "test.h"
+#include <algorithm>
+
+static const std::uint64_t BLOCKS = 4096;
+
+struct Config {
+  const char* mode;
+  std::size_t block_size, chunk_size;
+};
+
+// Both AEAD modes and CBC, with two copies of every chunk per block and with
+// a single one
+static const Config CONFIGS[] = {
+  {"GCM", 65536, 4096},
+  {"OCB", 65536, 4096},
+  {"CBC", 65536, 4096},
+  {"GCM", 4096, 4096},
+  {"CBC", 4096, 4096},
+};
+
+static Params volume_params(const Config& config) {
+  Params params;
+  params.block_size = config.block_size;
+  params.chunk_size = config.chunk_size;
+  params.iters = 10;
+  params.key_size = 32;
+  params.hash = "SHA256";
+  params.device_cipher = "aes-xts-plain64";
+  params.superblock_cipher = "AES256";
+  params.superblock_mode = config.mode;
+  params.salt = "test salt";
+  return params;
+}
+
+// A partition of n entries, mixing holes, runs and scattered blocks so that
+// chunks are encoded both as extents and raw. The superblock takes the
+// blocks after its root.
+static void fill(Superblock& superblock, std::uint64_t n) {
+  superblock.offset = Superblock::size_in_blocks(superblock.params, n);
+  for (std::uint64_t i = 1; i < superblock.offset; i++)
+    superblock.blocks.push_back((superblock.blocks.front()+i-1)%(BLOCKS-1)+1);
+  for (std::uint64_t i = 0; i < n; i++)
+    superblock.blocks.push_back(i%11 == 3 ? 0 : i%5 < 3 ? 1000+i :
+        (i*7919)%(BLOCKS-1)+1);
+}
+
+// Offset of chunk slot on the device
+static std::uint64_t slot_offset(const Superblock& superblock,
+    std::uint64_t slot) {
+  const Params& params = superblock.params;
+  std::size_t chunks_per_block = params.block_size/params.chunk_size;
+  return superblock.blocks.at(slot/chunks_per_block)*params.block_size+
+    slot%chunks_per_block*params.chunk_size;
+}
+
+static void flip(BlockDevice& device, std::uint64_t offset) {
+  char c;
+  device.pread(&c, 1, offset);
+  c ^= 1;
+  device.pwrite(&c, 1, offset);
+}
+
+enum LoadResult { LOADED, NO_SUPERBLOCK, FAILED };
+
+static LoadResult try_load(Superblock& superblock, BlockDevice& device) {
+  try {
+    superblock.load(device);
+    return LOADED;
+  } catch(const NoSuperblock&) {
+    return NO_SUPERBLOCK;
+  } catch(const std::exception&) {
+    return FAILED;
+  }
+}
+
+static void test_round_trip(const Config& config) {
+  Params params = volume_params(config);
+  BlockDevice device = BlockDevice::memory(BLOCKS*params.block_size);
+  Superblock superblock(params, "passphrase", BLOCKS);
+  fill(superblock, 3000);
+  superblock.run_length = 4;
+  superblock.logical_iv = true;
+  superblock.disk_key = SecureString("\x01\x00\xff", 3);
+  superblock.device_cipher = "aes-cbc-essiv:sha256";
+  superblock.store(device);
+  CHECK(superblock.chunks() >= 2);
+
+  Superblock loaded(params, "passphrase", BLOCKS);
+  loaded.load(device);
+  CHECK(loaded.blocks == superblock.blocks);
+  CHECK(loaded.offset == superblock.offset);
+  CHECK(loaded.run_length == 4);
+  CHECK(loaded.logical_iv);
+  CHECK(loaded.disk_key == superblock.disk_key);
+  CHECK(loaded.device_cipher == superblock.device_cipher);
+}
+
+static void test_corruption(const Config& config) {
+  Params params = volume_params(config);
+  BlockDevice device = BlockDevice::memory(BLOCKS*params.block_size);
+  Superblock superblock(params, "passphrase", BLOCKS);
+  fill(superblock, 3000);
+  superblock.store(device);
+  bool shadowed = params.block_size/params.chunk_size >= 2;
+
+  Superblock wrong(params, "wrong passphrase", BLOCKS);
+  CHECK(try_load(wrong, device) == NO_SUPERBLOCK);
+
+  // Any other chunk fails the load, but not as a missing superblock
+  std::uint64_t chunk = slot_offset(superblock, shadowed ? 2 : 1)+
+    params.chunk_size/2;
+  flip(device, chunk);
+  Superblock damaged(params, "passphrase", BLOCKS);
+  CHECK(try_load(damaged, device) == FAILED);
+  flip(device, chunk);
+
+  // The first store writes a single root, without which nothing is found
+  std::uint64_t root = slot_offset(superblock, 0)+params.chunk_size/2;
+  flip(device, root);
+  Superblock rootless(params, "passphrase", BLOCKS);
+  CHECK(try_load(rootless, device) == NO_SUPERBLOCK);
+  flip(device, root);
+
+  Superblock restored(params, "passphrase", BLOCKS);
+  CHECK(try_load(restored, device) == LOADED);
+  CHECK(restored.blocks == superblock.blocks);
+}
+
+// Later stores only rewrite what changed, and have to read back the same as
+// a full one
+static void test_incremental(const Config& config) {
+  Params params = volume_params(config);
+  BlockDevice device = BlockDevice::memory(BLOCKS*params.block_size);
+  Superblock superblock(params, "passphrase", BLOCKS);
+  fill(superblock, 3000);
+  superblock.store(device);
+  for (int generation = 0; generation < 4; generation++) {
+    Superblock loaded(params, "passphrase", BLOCKS);
+    loaded.load(device);
+    CHECK(loaded.blocks == superblock.blocks);
+    superblock.set(superblock.offset+100*generation, 3000+generation);
+    if (generation == 1)
+      superblock.resize(superblock.blocks.size()-700);
+    if (generation == 2)
+      for (std::uint64_t i = 0; i < 700; i++)
+        superblock.blocks.push_back(i%2 ? 0 : 2000+i);
+    superblock.store(device);
+  }
+  Superblock loaded(params, "passphrase", BLOCKS);
+  loaded.load(device);
+  CHECK(loaded.blocks == superblock.blocks);
+}
+
+// A store writes the changed chunks beside the current ones, and then the
+// root. Crashing before the root, or losing it, leaves the previous
+// superblock.
+static void test_crash(const Config& config) {
+  Params params = volume_params(config);
+  BlockDevice device = BlockDevice::memory(BLOCKS*params.block_size);
+  Superblock superblock(params, "passphrase", BLOCKS);
+  fill(superblock, 3000);
+  superblock.store(device);
+  auto old = superblock.blocks;
+
+  std::string roots(2*params.chunk_size, '\0');
+  std::uint64_t root = slot_offset(superblock, 0);
+  device.pread(&roots[0], roots.size(), root);
+  for (std::uint64_t i = 0; i < 3000; i += 50)
+    superblock.set(superblock.offset+i, 3500+i/50);
+  superblock.store(device);
+  auto stored = superblock.blocks;
+
+  std::string new_roots(roots.size(), '\0');
+  device.pread(&new_roots[0], new_roots.size(), root);
+  device.pwrite(roots.data(), roots.size(), root);
+  Superblock crashed(params, "passphrase", BLOCKS);
+  crashed.load(device);
+  CHECK(crashed.blocks == old);
+
+  // The second store put its root in the second slot
+  device.pwrite(new_roots.data(), new_roots.size(), root);
+  flip(device, slot_offset(superblock, 1)+params.chunk_size/2);
+  Superblock damaged(params, "passphrase", BLOCKS);
+  damaged.load(device);
+  CHECK(damaged.blocks == old);
+  flip(device, slot_offset(superblock, 1)+params.chunk_size/2);
+
+  Superblock loaded(params, "passphrase", BLOCKS);
+  loaded.load(device);
+  CHECK(loaded.blocks == stored);
+}
+
+static void put_le64(std::string& out, std::uint64_t i) {
+  for (int byte = 0; byte < 8; byte++)
+    out += char(i >> 8*byte);
+}
+
+static void put_varint(std::string& out, std::uint64_t i) {
+  for (; i >= 0x80; i >>= 7)
+    out += char(i | 0x80);
+  out += char(i);
+}
+
+// Seals chunks the way older versions did, independently of the code under
+// test, and writes them to consecutive slots from the root on
+static void write_chunks(BlockDevice& device, const Superblock& superblock,
+    const SecureString& passphrase, const std::vector<std::string>& chunks) {
+  const Params& params = superblock.params;
+  Hash hash(params.hash);
+  Symmetric cipher(params.superblock_cipher,
+      cipher_mode(params.superblock_mode));
+  SecureString key = PBKDF2::PBKDF2(hash, passphrase, params.salt,
+      params.iters, cipher.key_size()+(cipher.aead() ? 0 :
+        cipher.block_size()));
+  cipher.set_key(key.data(), cipher.key_size());
+  for (std::size_t i = 0; i < chunks.size(); i++) {
+    std::string chunk;
+    if (cipher.aead()) {
+      std::string chunk_nonce = nonce(12);
+      std::string index;
+      put_le64(index, i);
+      std::string data = chunks[i];
+      data.resize(params.chunk_size-12-16, '\0');
+      cipher.reset(chunk_nonce);
+      cipher.authenticate(index);
+      cipher.final();
+      data = cipher.encrypt(data);
+      chunk = chunk_nonce + data + cipher.tag();
+    } else {
+      // A checksum of the whole chunk, then the data
+      chunk.assign(params.chunk_size, '\0');
+      std::copy(chunks[i].begin(), chunks[i].end(), chunk.begin()+
+          (hash.size()+7)/8*8);
+      hash.reset();
+      hash.update(chunk);
+      std::string checksum = hash.digest();
+      std::copy(checksum.begin(), checksum.end(), chunk.begin());
+      cipher.reset(key.data()+cipher.key_size(), cipher.block_size());
+      chunk = cipher.encrypt(chunk);
+    }
+    device.pwrite(chunk.data(), chunk.size(), slot_offset(superblock, i));
+  }
+}
+
+static std::vector<std::uint64_t> scattered(std::uint64_t n) {
+  std::vector<std::uint64_t> entries;
+  for (std::uint64_t i = 0; i < n; i++)
+    entries.push_back(i%7 == 3 ? 0 : (i*7919)%(BLOCKS-1)+1);
+  return entries;
+}
+
+// Superblocks from before the versioned format: the number of entries and
+// every entry as a 64-bit integer, split over as many chunks as needed
+static void test_legacy() {
+  Params params = volume_params({"CBC", 4096, 4096});
+  BlockDevice device = BlockDevice::memory(BLOCKS*params.block_size);
+  SecureString passphrase("legacy");
+  Superblock superblock(params, passphrase, BLOCKS);
+  auto entries = scattered(1000);
+  std::string data;
+  std::size_t payload = (params.chunk_size-32)/8*8;
+  std::size_t offset = ((entries.size()+3)*8+payload-1)/payload;
+  put_le64(data, offset-1+entries.size());
+  for (std::size_t i = 1; i < offset; i++) {
+    superblock.blocks.push_back(superblock.blocks.front()+i);
+    put_le64(data, superblock.blocks.back());
+  }
+  for (auto entry : entries)
+    put_le64(data, entry);
+  std::vector<std::string> chunks;
+  for (std::size_t i = 0; i < data.size(); i += payload)
+    chunks.push_back(data.substr(i, payload));
+  CHECK(chunks.size() == offset);
+  write_chunks(device, superblock, passphrase, chunks);
+  auto expected = superblock.blocks;
+  expected.insert(expected.end(), entries.begin(), entries.end());
+
+  Superblock loaded(params, passphrase, BLOCKS);
+  loaded.load(device);
+  CHECK(loaded.blocks == expected);
+  CHECK(loaded.offset == offset);
+  CHECK(!loaded.crash_safe());
+
+  // The first store upgrades it in place
+  loaded.set(offset+10, 4000);
+  expected[offset+10] = 4000;
+  loaded.store(device);
+  Superblock upgraded(params, passphrase, BLOCKS);
+  upgraded.load(device);
+  CHECK(upgraded.blocks == expected);
+}
+
+// Version 1: a versioned root, then every chunk once, with raw entries
+static void test_v1() {
+  Params params = volume_params({"GCM", 65536, 4096});
+  BlockDevice device = BlockDevice::memory(BLOCKS*params.block_size);
+  SecureString passphrase("version 1");
+  Superblock superblock(params, passphrase, BLOCKS);
+  auto entries = scattered(1200);
+  std::size_t payload = (params.chunk_size-12-16)/8*8;
+  std::vector<std::string> chunks;
+  std::size_t next = 0;
+  while (next < entries.size()) {
+    std::size_t room = payload-1-2-(chunks.empty() ? 8+3*3 : 0);
+    std::size_t n = std::min(room/8, entries.size()-next);
+    std::string chunk(1, '\0');
+    put_varint(chunk, n);
+    for (std::size_t i = next; i < next+n; i++)
+      put_le64(chunk, entries[i]);
+    chunks.push_back(chunk);
+    next += n;
+  }
+  CHECK(chunks.size() == 3);
+  std::string root;
+  put_le64(root, std::uint64_t(1) << 63 | 1);
+  put_varint(root, entries.size());
+  put_varint(root, 1);
+  put_varint(root, chunks.size());
+  chunks.front() = root + chunks.front();
+  write_chunks(device, superblock, passphrase, chunks);
+  auto expected = superblock.blocks;
+  expected.insert(expected.end(), entries.begin(), entries.end());
+
+  Superblock loaded(params, passphrase, BLOCKS);
+  loaded.load(device);
+  CHECK(loaded.blocks == expected);
+  CHECK(loaded.offset == 1);
+  CHECK(!loaded.crash_safe());
+
+  // Rewritten with two copies of every chunk, after which stores are safe
+  loaded.set(1+10, 4000);
+  expected[1+10] = 4000;
+  loaded.store(device);
+  CHECK(loaded.crash_safe());
+  Superblock upgraded(params, passphrase, BLOCKS);
+  upgraded.load(device);
+  CHECK(upgraded.blocks == expected);
+}
+
+int main()
+  try {
+    for (const auto& config : CONFIGS) {
+      test_round_trip(config);
+      test_corruption(config);
+      if (config.block_size/config.chunk_size >= 2) {
+        test_incremental(config);
+        test_crash(config);
+      }
+    }
+    test_legacy();
+    test_v1();
+    return test::result();
+  } catch(const std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
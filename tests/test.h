@@ -0,0 +1,48 @@
+#ifndef TESTS_TEST_H_
+#define TESTS_TEST_H_
+
+#include <iostream>
+
+// Tests are plain programs that report every failed check and exit with a
+// non-zero status if there was one.
+
+namespace test {
+
+inline int& failures() {
+  static int failures = 0;
+  return failures;
+}
+
+inline void fail(const char* file, int line, const char* what) {
+  std::cerr << file << ":" << line << ": " << what << std::endl;
+  failures()++;
+}
+
+inline int result() {
+  if (failures() != 0)
+    std::cerr << failures() << " checks failed." << std::endl;
+  return failures() != 0;
+}
+
+}  // namespace test
+
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) \
+      test::fail(__FILE__, __LINE__, "CHECK(" #condition ") failed"); \
+  } while (0)
+
+// Exceptions of other types fail the whole test
+#define CHECK_THROWS(statement, exception) \
+  do { \
+    bool thrown = false; \
+    try { \
+      statement; \
+    } catch(const exception&) { \
+      thrown = true; \
+    } \
+    if (!thrown) \
+      test::fail(__FILE__, __LINE__, #statement " didn't throw " #exception); \
+  } while (0)
+
+#endif  // TESTS_TEST_H_
@@ -0,0 +1,39 @@
+#include "../util.h"
+#include "test.h"
+
+static void test_parse_size() {
+  CHECK(parse_size("0") == 0);
+  CHECK(parse_size("12") == 12);
+  CHECK(parse_size("12K") == 12 << 10);
+  CHECK(parse_size("4M") == 4 << 20);
+  CHECK(parse_size("3G") == std::uint64_t(3) << 30);
+  CHECK(parse_size("16T") == std::uint64_t(16) << 40);
+  CHECK(parse_size("16383P") == std::uint64_t(16383) << 50);
+  CHECK(parse_size("18446744073709551615") ==
+      std::numeric_limits<std::uint64_t>::max());
+
+  CHECK_THROWS(parse_size(""), std::invalid_argument);
+  CHECK_THROWS(parse_size("abc"), std::invalid_argument);
+  CHECK_THROWS(parse_size("K"), std::invalid_argument);
+  CHECK_THROWS(parse_size("-5"), std::invalid_argument);
+  CHECK_THROWS(parse_size("+5"), std::invalid_argument);
+  CHECK_THROWS(parse_size(" 5"), std::invalid_argument);
+  CHECK_THROWS(parse_size("12X"), std::invalid_argument);
+  CHECK_THROWS(parse_size("12k"), std::invalid_argument);
+  CHECK_THROWS(parse_size("12KB"), std::invalid_argument);
+  // Too large to read at all
+  CHECK_THROWS(parse_size("18446744073709551616"), std::invalid_argument);
+
+  CHECK_THROWS(parse_size("16384P"), std::out_of_range);
+  CHECK_THROWS(parse_size("20000P"), std::out_of_range);
+  CHECK_THROWS(parse_size("18446744073709551615K"), std::out_of_range);
+}
+
+int main()
+  try {
+    test_parse_size();
+    return test::result();
+  } catch(const std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
@@ -1,7 +1,10 @@
 #ifndef UTIL_H_
 #define UTIL_H_
 
+#include <cctype>
 #include <cstdint>
+#include <limits>
+#include <stdexcept>
 #include <string>
 #include <system_error>
 #include <sstream>
@@ -29,73 +32,26 @@ template <class T> T from_string(const std::string& str) {
   return ret;
 }
 
-static inline std::string htole32_str(std::uint32_t i) {
-#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-  return std::string(reinterpret_cast<char*>(&i), 4);
-#else
-  std::string ret(4, '\x00');
-  ret[0] = (i >> 24) & 0xFF;
-  ret[1] = (i >> 16) & 0xFF;
-  ret[2] = (i >> 8) & 0xFF;
-  ret[3] = i & 0xFF;
-  return ret;
-#endif
-}
-
-static inline std::uint32_t le32toh_str(const std::string& str) {
-#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-  return *reinterpret_cast<const std::uint32_t*>(str.data());
-#else
-  return (((((str[0] << 8) | str[1]) << 8) | str[2]) << 8) | str[3];
-#endif
-}
-
-static inline std::string htole64_str(std::uint64_t i) {
-#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-  return std::string(reinterpret_cast<char*>(&i), 8);
-#else
-  std::string ret(8, '\x00');
-  ret[0] = (i >> 56) & 0xFF;
-  ret[1] = (i >> 48) & 0xFF;
-  ret[2] = (i >> 40) & 0xFF;
-  ret[3] = (i >> 32) & 0xFF;
-  ret[4] = (i >> 24) & 0xFF;
-  ret[5] = (i >> 16) & 0xFF;
-  ret[6] = (i >> 8) & 0xFF;
-  ret[7] = i & 0xFF;
-  return ret;
-#endif
-}
-
-static inline std::uint64_t le64toh_str(const std::string& str) {
-#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-  return *reinterpret_cast<const std::uint64_t*>(str.data());
-#else
-  return (((((((((((((((str[0] << 8) | str[1]) << 8) | str[2]) << 8) |
-                        str[3]) << 8) | str[4]) << 8) | str[5]) << 8) |
-            str[6]) << 8) | str[7]) << 8);
-#endif
-}
-
-static inline std::string htobe32_str(std::uint32_t i) {
-#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
-  return std::string(reinterpret_cast<char*>(&i), 4);
-#else
-  std::string ret(4, '\x00');
-  ret[0] = i & 0xFF;
-  ret[1] = (i >> 8) & 0xFF;
-  ret[2] = (i >> 16) & 0xFF;
-  ret[3] = (i >> 24) & 0xFF;
-  return ret;
-#endif
-}
-
-static inline std::uint32_t be32toh_str(const std::string& str) {
-#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
-    return *reinterpret_cast<const std::uint32_t*>(str.data());
-#else
-    return (((((str[3] << 8) | str[2]) << 8) | str[1]) << 8) | str[0];
-#endif
+// Bytes, with an optional K, M, G, T or P suffix
+static inline std::uint64_t parse_size(const std::string& str) {
+  std::stringstream ss(str);
+  std::uint64_t size;
+  char suffix;
+  // Digits first, as a sign would be taken modulo 2^64
+  if (str.empty() || !std::isdigit(static_cast<unsigned char>(str[0])) ||
+      !(ss >> size))
+    throw std::invalid_argument("invalid size: " + str);
+  unsigned shift = 0;
+  if (ss >> suffix) {
+    const std::string SUFFIXES = "KMGTP";
+    auto unit = SUFFIXES.find(suffix);
+    if (unit == std::string::npos || ss.peek() != EOF)
+      throw std::invalid_argument("invalid size: " + str);
+    shift = 10*(unit+1);
+  }
+  if (size > std::numeric_limits<std::uint64_t>::max() >> shift)
+    throw std::out_of_range("size too large: " + str);
+  return size << shift;
 }
 
 #endif
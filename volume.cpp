@@ -0,0 +1,169 @@
+#include "volume.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+Volume::Volume(const std::string& path, bool read_only)
+  : _device(path, read_only) {
+  _params.load(_device);
+  if (!_params.devices.empty())
+    throw std::runtime_error("volumes on several devices aren't supported");
+}
+
+const Params& Volume::params() const {
+  return _params;
+}
+
+std::uint64_t Volume::blocks() const {
+  return _device.size()/_params.block_size;
+}
+
+BlockDevice& Volume::device() {
+  return _device;
+}
+
+Partition::Partition(Volume& volume, const SecureString& passphrase,
+    std::size_t cache_blocks)
+  : _volume(volume), _block_size(volume.params().block_size),
+    _superblock(volume.params(), passphrase, volume.blocks()),
+    _capacity(std::max<std::size_t>(cache_blocks, 1)) {
+  _superblock.load(volume.device());
+  const Params& params = volume.params();
+  _cipher.reset(new DiskCipher(
+        _superblock.device_cipher.empty() ? params.device_cipher :
+          _superblock.device_cipher,
+        _superblock.disk_key.empty() ? params.disk_key(passphrase) :
+          _superblock.disk_key));
+  if (!_superblock.next_key.empty())
+    _next_cipher.reset(new DiskCipher(_superblock.next_cipher,
+          _superblock.next_key));
+}
+
+Partition::~Partition() {
+  try {
+    flush();
+  } catch(...) {
+  }
+}
+
+std::uint64_t Partition::size() const {
+  return std::uint64_t(_superblock.blocks.size()-_superblock.offset)*
+    _block_size;
+}
+
+const Superblock& Partition::superblock() const {
+  return _superblock;
+}
+
+DiskCipher& Partition::cipher(std::size_t index) {
+  return _next_cipher && index < _superblock.reencrypted ? *_next_cipher :
+    *_cipher;
+}
+
+std::uint64_t Partition::sector(std::size_t index) const {
+  return _superblock.logical_iv ? std::uint64_t(index)*_block_size/512 : 0;
+}
+
+// Moves block index to the front of the cache, reading it in if read is set
+Partition::Cache::iterator Partition::get(std::size_t index, bool read) {
+  auto found = _index.find(index);
+  if (found != _index.end()) {
+    _cache.splice(_cache.begin(), _cache, found->second);
+    return _cache.begin();
+  }
+
+  if (_cache.size() >= _capacity) {
+    if (_cache.back().dirty)
+      write_back();
+    _index.erase(_cache.back().index);
+    _cache.pop_back();
+  }
+
+  Block block{index, std::unique_ptr<char[]>(new char[_block_size]), false};
+  std::uint64_t physical = _superblock.blocks[_superblock.offset+index];
+  if (physical == 0) {
+    std::memset(block.data.get(), 0, _block_size);
+  } else if (read) {
+    _volume.device().pread(block.data.get(), _block_size,
+        physical*_block_size);
+    cipher(index).decrypt(block.data.get(), _block_size, sector(index));
+  }
+  _cache.push_front(std::move(block));
+  _index[index] = _cache.begin();
+  return _cache.begin();
+}
+
+std::size_t Partition::pread(void* buf, std::size_t n, std::uint64_t offset) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (offset >= size())
+    return 0;
+  n = std::min<std::uint64_t>(n, size()-offset);
+  char* out = static_cast<char*>(buf);
+  for (std::size_t done = 0; done < n; ) {
+    std::size_t index = (offset+done)/_block_size;
+    std::size_t within = (offset+done)%_block_size;
+    std::size_t length = std::min(n-done, _block_size-within);
+    std::memcpy(out+done, get(index, true)->data.get()+within, length);
+    done += length;
+  }
+  return n;
+}
+
+void Partition::pwrite(const void* buf, std::size_t n, std::uint64_t offset) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (offset > size() || n > size()-offset)
+    throw std::out_of_range("write past the end of the partition");
+  const char* in = static_cast<const char*>(buf);
+  for (std::size_t done = 0; done < n; ) {
+    std::size_t index = (offset+done)/_block_size;
+    std::size_t within = (offset+done)%_block_size;
+    std::size_t length = std::min(n-done, _block_size-within);
+    if (_superblock.blocks[_superblock.offset+index] == 0)
+      throw std::out_of_range("write to an unmapped block");
+    // Whole blocks don't have to be read first
+    auto block = get(index, length != _block_size);
+    std::memcpy(block->data.get()+within, in+done, length);
+    block->dirty = true;
+    done += length;
+  }
+}
+
+void Partition::flush() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  write_back();
+}
+
+void Partition::write_back() {
+  std::vector<Block*> dirty;
+  for (auto& block : _cache)
+    if (block.dirty)
+      dirty.push_back(&block);
+  if (dirty.empty())
+    return;
+  auto physical = [&](const Block* block) {
+    return _superblock.blocks[_superblock.offset+block->index];
+  };
+  std::sort(dirty.begin(), dirty.end(), [&](const Block* a, const Block* b) {
+    return physical(a) < physical(b);
+  });
+
+  std::vector<char> buf;
+  for (auto first = dirty.begin(); first != dirty.end(); ) {
+    auto last = first+1;
+    while (last != dirty.end() && physical(*last) == physical(*(last-1))+1)
+      ++last;
+    buf.resize((last-first)*_block_size);
+    char* p = buf.data();
+    for (auto block = first; block != last; ++block, p += _block_size) {
+      std::memcpy(p, (*block)->data.get(), _block_size);
+      cipher((*block)->index).encrypt(p, _block_size,
+          sector((*block)->index));
+    }
+    _volume.device().pwrite(buf.data(), buf.size(),
+        physical(*first)*_block_size);
+    for (auto block = first; block != last; ++block)
+      (*block)->dirty = false;
+    first = last;
+  }
+  _volume.device().sync();
+}
@@ -0,0 +1,81 @@
+#ifndef VOLUME_H_
+#define VOLUME_H_
+
+#include "blockdevice.h"
+#include "diskcipher.h"
+#include "header.h"
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Library interface to volumes, reading and writing partitions in userspace
+// without device-mapper.
+
+class Volume {
+ public:
+  explicit Volume(const std::string& path, bool read_only = false);
+  Volume(const Volume&) = delete;
+  Volume& operator=(const Volume&) = delete;
+
+  const Params& params() const;
+  std::uint64_t blocks() const;
+  BlockDevice& device();
+
+ private:
+  BlockDevice _device;
+  Params _params;
+};
+
+// A partition unlocked with its passphrase, accessed through an LRU cache of
+// decrypted blocks. Writes stay in the cache until they are evicted or
+// flushed, and are then written out sorted, physically contiguous blocks in
+// one request. Calls from several threads are serialized.
+class Partition {
+ public:
+  Partition(Volume& volume, const SecureString& passphrase,
+      std::size_t cache_blocks = 16);
+  Partition(const Partition&) = delete;
+  Partition& operator=(const Partition&) = delete;
+  // Flushes, ignoring errors; call flush() first to see them
+  ~Partition();
+
+  // Size in bytes
+  std::uint64_t size() const;
+  const Superblock& superblock() const;
+
+  // Return the number of bytes read, short only past the end. Unmapped
+  // blocks read as zeroes and can't be written.
+  std::size_t pread(void* buf, std::size_t n, std::uint64_t offset);
+  void pwrite(const void* buf, std::size_t n, std::uint64_t offset);
+  // Writes out every modified block and syncs the volume
+  void flush();
+
+ private:
+  struct Block {
+    std::size_t index;
+    std::unique_ptr<char[]> data;
+    bool dirty;
+  };
+  typedef std::list<Block> Cache;
+
+  Cache::iterator get(std::size_t index, bool read);
+  DiskCipher& cipher(std::size_t index);
+  std::uint64_t sector(std::size_t index) const;
+  void write_back();
+
+  Volume& _volume;
+  std::size_t _block_size;
+  Superblock _superblock;
+  std::unique_ptr<DiskCipher> _cipher, _next_cipher;
+  std::size_t _capacity;
+  // Most recently used first
+  Cache _cache;
+  std::unordered_map<std::size_t, Cache::iterator> _index;
+  std::mutex _mutex;
+};
+
+#endif  // VOLUME_H_